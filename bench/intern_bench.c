@@ -0,0 +1,143 @@
+/* Scalability of the shared intern table: every thread interns keys drawn
+ * at random from a common pool, so most operations are lookup hits and the
+ * rest race to insert. Each thread count runs once against the lock-free
+ * lookups and once with a single mutex around every operation, as a
+ * baseline.
+ *
+ * Usage: intern_bench [maxThreads] [keys] [operationsPerThread] */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+typedef struct {
+    InternTable* table;
+    pthread_mutex_t* lock;
+    char** keys;
+    int* lengths;
+    uint32_t* hashes;
+    int keyCount;
+    long operations;
+    uint64_t seed;
+} Worker;
+
+static uint32_t hashString(const char* key, int length){
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static uint64_t nextRandom(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static ObjString* intern(Worker* worker, int key){
+    const char* chars = worker->keys[key];
+    int length = worker->lengths[key];
+    uint32_t hash = worker->hashes[key];
+
+    ObjString* string = internFind(worker->table, chars, length, hash);
+    if (string != NULL) return string;
+
+    string = ALLOCATE(ObjString, 1);
+    string->Obj.type = OBJ_STRING;
+    string->Obj.next = NULL;
+    string->length = length;
+    string->hash = hash;
+    string->chars = ALLOCATE(char, length + 1);
+    memcpy(string->chars, chars, length + 1);
+
+    ObjString* interned = internAdd(worker->table, string);
+    if (interned != string) {
+        FREE_ARRAY(char, string->chars, length + 1);
+        FREE(ObjString, string);
+    }
+    return interned;
+}
+
+static void* run(void* arg){
+    Worker* worker = (Worker*) arg;
+    for (long i = 0; i < worker->operations; i++) {
+        int key = (int) (nextRandom(&worker->seed) % worker->keyCount);
+        if (worker->lock != NULL) pthread_mutex_lock(worker->lock);
+        ObjString* string = intern(worker, key);
+        if (worker->lock != NULL) pthread_mutex_unlock(worker->lock);
+        if (string->length != worker->lengths[key]) abort();
+    }
+    return NULL;
+}
+
+static double measure(int threads, bool locked, char** keys, int* lengths, uint32_t* hashes,
+                      int keyCount, long operations){
+    InternTable table;
+    initInternTable(&table);
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+
+    Worker* workers = malloc(sizeof(Worker) * threads);
+    pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker) {&table, locked ? &lock : NULL, keys, lengths, hashes,
+                               keyCount, operations, 0x9E3779B97F4A7C15ull * (i + 1)};
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) pthread_create(&ids[i], NULL, run, &workers[i]);
+    for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (atomic_load(&table.count) > keyCount) {
+        fprintf(stderr, "Interned %d strings for %d keys.\n", atomic_load(&table.count), keyCount);
+        exit(1);
+    }
+
+    free(workers);
+    free(ids);
+    pthread_mutex_destroy(&lock);
+    freeInternTable(&table);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return threads * operations / seconds / 1e6;
+}
+
+int main(int argc, char* argv[]){
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    int keyCount = argc > 2 ? atoi(argv[2]) : 100000;
+    long operations = argc > 3 ? atol(argv[3]) : 2000000;
+
+    char** keys = malloc(sizeof(char*) * keyCount);
+    int* lengths = malloc(sizeof(int) * keyCount);
+    uint32_t* hashes = malloc(sizeof(uint32_t) * keyCount);
+    for (int i = 0; i < keyCount; i++) {
+        char buffer[32];
+        lengths[i] = snprintf(buffer, sizeof(buffer), "key%d", i);
+        keys[i] = strdup(buffer);
+        hashes[i] = hashString(keys[i], lengths[i]);
+    }
+
+    printf("%7s %14s %14s\n", "threads", "lock-free M/s", "mutex M/s");
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double lockFree = measure(threads, false, keys, lengths, hashes, keyCount, operations);
+        double mutex = measure(threads, true, keys, lengths, hashes, keyCount, operations);
+        printf("%7d %14.2f %14.2f\n", threads, lockFree, mutex);
+    }
+
+    for (int i = 0; i < keyCount; i++) free(keys[i]);
+    free(keys);
+    free(lengths);
+    free(hashes);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "chunk.h"
+
+/* A bounded LRU cache of compiled chunks, keyed by a 64-bit hash of the
+ * source and confirmed with a full comparison. Lookups hand out pinned
+ * entries that stay valid until released, even if they're evicted or
+ * invalidated in the meantime. */
+
+#define CHUNK_CACHE_CAPACITY 256
+#define CHUNK_CACHE_BUCKETS 512
+
+typedef struct CachedChunk {
+    uint64_t hash;
+    char* source;
+    int length;
+    // Compiled with --registers; the same source compiles differently without.
+    bool registerCode;
+    Chunk chunk;
+    int pins;
+    bool cached;
+    struct CachedChunk* nextInBucket;
+    struct CachedChunk* newer;
+    struct CachedChunk* older;
+} CachedChunk;
+
+typedef struct {
+    CachedChunk* buckets[CHUNK_CACHE_BUCKETS];
+    CachedChunk* newest;
+    CachedChunk* oldest;
+    int count;
+    int capacity;
+    uint64_t hits;
+    uint64_t misses;
+} ChunkCache;
+
+void initChunkCache(ChunkCache* cache, int capacity);
+void freeChunkCache(ChunkCache* cache);
+// Both return a pinned entry. addCached's chunk is empty, ready to compile into.
+CachedChunk* findCached(ChunkCache* cache, const char* source, int length, bool registerCode);
+CachedChunk* addCached(ChunkCache* cache, const char* source, int length, bool registerCode);
+void releaseCached(ChunkCache* cache, CachedChunk* entry);
+// Drops the entry from the cache; it's freed once its last pin is released.
+void invalidateCached(ChunkCache* cache, CachedChunk* entry);
+void clearChunkCache(ChunkCache* cache);
+
+#endif //CLOX_CACHE_H
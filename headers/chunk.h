@@ -2,6 +2,7 @@
 #define CLOX_CHUNK_H
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 typedef enum {
@@ -17,6 +18,8 @@ typedef enum {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    // Pops a value and jumps to its case; carries a 16-bit switch table index.
+    OP_SWITCH,
     OP_NOT,
     OP_EQUAL,
     OP_GREATER,
@@ -28,19 +31,122 @@ typedef enum {
     OP_NEGATE,
     OP_PRINT,
     OP_POP,
+    OP_CALL,
+    OP_TAIL_CALL,
+    OP_BUILD_LIST,
+    OP_BUILD_MAP,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    // The property ops carry a 16-bit inline cache index after their operands.
+    OP_CLASS,
+    OP_INHERIT,
+    OP_METHOD,
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE,
+    OP_GET_SUPER,
+    OP_SUPER_INVOKE,
     OP_RETURN,
+
+    // Register forms, emitted with --registers. Each operand is a register
+    // byte: a local slot, or a constant index when REGISTER_CONSTANT is set.
+    // The _RK ops push their result; the _RK_SET ops store it into a local.
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_EQUAL_RK,
+    OP_GREATER_RK,
+    OP_LESS_RK,
+    OP_ADD_RK_SET,
+    OP_SUBTRACT_RK_SET,
+    OP_MULTIPLY_RK_SET,
+    OP_DIVIDE_RK_SET,
+
+    // Quickened forms. run() rewrites a generic instruction into one of these
+    // in place once it has seen its operand types, and back if they change.
+    // Each has the same length as its generic form, see genericOpcode().
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+
+    // Emitted when the compiler has proven both operands are numbers.
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_GREATER_UNCHECKED,
+    OP_LESS_UNCHECKED,
+    OP_NEGATE_UNCHECKED,
 }OpCode;
 
+#define REGISTER_CONSTANT 0x80
+#define REGISTER_MAX 0x7f
+
+#define CACHE_ENTRIES 4
+
+/* What a property instruction did for instances of one shape: the field
+ * index it read or wrote, plus the shape a set moved the instance to or the
+ * method an invoke called (`target`). */
+typedef struct {
+    ObjShape* shape;
+    Obj* target;
+    int index;
+} CacheEntry;
+
+// Up to CACHE_ENTRIES shapes per instruction; sites that see more go uncached.
+typedef struct {
+    CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
+/* Where an OP_SWITCH jumps for each case value, as offsets from the end of
+ * the instruction. Cases that are all whole numbers close together index
+ * `offsets` from `low`, with `defaultOffset` in the gaps; the rest look the
+ * value up in `cases`, which maps each one to its offset as a number. */
+typedef struct JitCode JitCode;
+
+typedef struct {
+    bool dense;
+    int low;
+    int count;
+    int* offsets;
+    Table cases;
+    int defaultOffset;
+} SwitchTable;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    int cacheCount;
+    InlineCache* caches;
+    int switchCount;
+    SwitchTable* switches;
+    // The most stack slots a call running this chunk uses, its own included.
+    int maxStack;
+    // Native code, made with --jit the first time the chunk runs.
+    JitCode* jit;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+// Returns the index of a new, empty inline cache.
+int addCache(Chunk* chunk);
+// Returns the index of a new switch table with no cases.
+int addSwitch(Chunk* chunk);
+int instructionLength(uint8_t instruction);
+uint8_t genericOpcode(uint8_t instruction);
+/* The deepest the stack gets while running the chunk, starting from `depth`
+ * slots (the callee and its arguments). Calls only need to check for room
+ * once, on entry. */
+int maxStackDepth(Chunk* chunk, int depth);
+void unquickenChunk(Chunk* chunk);
 #endif
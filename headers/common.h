@@ -5,9 +5,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Both of these can also be switched on per run with --disassemble / --trace.
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_TIMELINE
+//#define DEBUG_STATS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Defined in vm.h; declared here since objects are allocated per VM.
+typedef struct VM VM;
+
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
 #endif
@@ -3,6 +3,8 @@
 
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+bool compile(VM* vm, const char* source, Chunk* chunk);
+// For source that starts partway through a file, at `line`.
+bool compileFrom(VM* vm, const char* source, int line, Chunk* chunk);
 
 #endif //CLOX_COMPILER_H
@@ -3,7 +3,7 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name);
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef CLOX_FIBER_H
+#define CLOX_FIBER_H
+
+#include "vm.h"
+
+/* Switching between fibers and scheduling them. A switch saves the running
+ * fiber's ip, stack top and frame count and loads the next one's, so it
+ * costs about as much as a call. Fibers nobody resumes by hand (spawned
+ * ones, any that yield with nobody to yield to, and those whose I/O has
+ * finished) take turns from a FIFO run queue; when the script finishes,
+ * the queue runs until it's empty and no fiber is waiting on I/O.
+ *
+ * The natives that switch take `result`, the slot where the running fiber
+ * gets handed a value once it continues, and leave the stack top just
+ * above it. */
+
+void initFibers(VM* vm);
+void freeFibers(VM* vm);
+// Back to an empty main fiber after an error. The failed fiber and the ones
+// waiting on it are done, as are all queued fibers and those parked on I/O.
+void resetFibers(VM* vm);
+
+// Room for one more frame on the running fiber.
+bool growFrames(VM* vm);
+// Room for `needed` slots on the running fiber's stack. Moves the stack.
+bool growStack(VM* vm, int needed);
+
+bool resumeFiber(VM* vm, ObjFiber* fiber, Value value, Value* result);
+void yieldFiber(VM* vm, Value value, Value* result);
+// Queues a new fiber to run once the running one yields or finishes.
+void spawnFiber(VM* vm, ObjFiber* fiber, Value value);
+// Parks the running fiber until wakeFiber() queues it again with its result.
+void blockFiber(VM* vm, Value* result);
+void wakeFiber(VM* vm, ObjFiber* fiber, Value value);
+/* The running fiber's bottom frame has returned, its result on top of the
+ * stack. Switches to its caller or the next queued fiber; false when there
+ * is nothing left to run. */
+bool finishFiber(VM* vm);
+// Leaves the idle main fiber for the next queued one; false when there is none.
+bool enterQueuedFiber(VM* vm);
+
+#endif //CLOX_FIBER_H
@@ -0,0 +1,27 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "vm.h"
+
+/* Heap images: every object on vm->objects plus the vm->globals and
+ * vm->strings tables, written out so that a fresh VM can boot from them
+ * with one mmap. Images are laid out for IMAGE_BASE; when the mapping lands
+ * there nothing needs patching, otherwise the pointers listed in the image's
+ * relocation table are shifted. Natives and fibers are left out: a global
+ * or map entry holding one is dropped and a list item holding one loads as
+ * nil. The natives are defined again after loading. Objects loaded from an
+ * image stay in the mapping for the VM's lifetime and are not on
+ * vm->objects. Images are only valid for the build that wrote them. */
+
+#define IMAGE_BASE ((uintptr_t) 0x200000000000)
+
+bool saveImage(VM* vm, const char* path);
+// Loads into a VM that has just been initialized; reports errors on stderr.
+bool loadImage(VM* vm, const char* path);
+void freeImage(VM* vm);
+// Remembers that an image chunk got native code, for freeImage() to free.
+void keepImageJit(VM* vm, Chunk* chunk);
+// Whether `pointer` points into the VM's image, where arrays can't be reallocated.
+bool inImage(VM* vm, const void* pointer);
+
+#endif //CLOX_IMAGE_H
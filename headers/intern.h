@@ -0,0 +1,40 @@
+#ifndef CLOX_INTERN_H
+#define CLOX_INTERN_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "value.h"
+
+/* A string intern table that several VMs on different threads can share.
+ * Lookups take no locks: they read the current entry array and probe it
+ * with atomic loads. Insertions lock one of INTERN_STRIPES mutexes chosen
+ * by hash, so equal strings always serialize on the same stripe while
+ * unrelated ones claim empty slots with a compare-and-swap. Growing takes
+ * every stripe; replaced arrays are kept until the table is freed since a
+ * lookup may still be reading them. */
+
+#define INTERN_STRIPES 32
+#define INTERN_MAX_LOAD 0.75
+
+typedef struct InternArray {
+    int capacity;
+    struct InternArray* retired;
+    _Atomic(ObjString*) entries[];
+} InternArray;
+
+typedef struct {
+    _Atomic(InternArray*) array;
+    atomic_int count;
+    pthread_mutex_t stripes[INTERN_STRIPES];
+} InternTable;
+
+void initInternTable(InternTable* table);
+// Frees the table along with every string interned in it.
+void freeInternTable(InternTable* table);
+ObjString* internFind(InternTable* table, const char* chars, int length, uint32_t hash);
+// Interns `string` and returns it, or the equal string another thread interned first.
+ObjString* internAdd(InternTable* table, ObjString* string);
+
+#endif //CLOX_INTERN_H
@@ -0,0 +1,62 @@
+#ifndef CLOX_IO_H
+#define CLOX_IO_H
+
+#include "common.h"
+#include "object.h"
+
+/* Non-blocking I/O for fibers. Descriptors made by the I/O natives are
+ * non-blocking, and an operation that would block parks the calling fiber
+ * on the VM's epoll instance and runs the next one. The scheduler polls
+ * when it runs out of fibers to run, and every IO_POLL_INTERVAL switches
+ * so busy fibers can't starve the rest. Each operation whose descriptor
+ * became ready is finished there and its fiber queued with the result. */
+
+#define IO_POLL_INTERVAL 64
+
+typedef enum {
+    IO_READ,
+    IO_WRITE,
+    IO_ACCEPT,
+    IO_CONNECT,
+} IoOperation;
+
+// A parked operation; `fiber` is NULL when there is none.
+typedef struct {
+    ObjFiber* fiber;
+    IoOperation operation;
+    // Most bytes to read, or how much of `data` has been written.
+    int count;
+    ObjString* data;
+} IoWait;
+
+// At most one reader and one writer per descriptor.
+typedef struct {
+    IoWait reader;
+    IoWait writer;
+    // What it's registered for on the epoll instance; 0 when it isn't.
+    uint32_t events;
+} IoDescriptor;
+
+typedef struct {
+    // Made on the first operation that has to wait.
+    int epoll;
+    // Number of fibers parked.
+    int waiting;
+    int sincePoll;
+    // Indexed by file descriptor.
+    IoDescriptor* descriptors;
+    int capacity;
+} IoLoop;
+
+void initIoLoop(IoLoop* io);
+void freeIoLoop(IoLoop* io);
+// In a child after fork(): the epoll instance is shared with the parent.
+void forgetIoLoop(IoLoop* io);
+/* Finishes the operations that are ready and queues their fibers. With
+ * `block`, waits until at least one descriptor is ready. */
+void pollIo(VM* vm, bool block);
+// Drops every parked operation, queueing its fiber with nil.
+void cancelIo(VM* vm);
+void defineIoNatives(VM* vm);
+
+#endif //CLOX_IO_H
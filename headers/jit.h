@@ -0,0 +1,30 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "chunk.h"
+
+/* A baseline template JIT: every bytecode instruction is translated into a
+ * fixed x86-64 sequence that works on the VM's own value stack, so at any
+ * instruction boundary execution can hand over to run(), or back, with
+ * nothing more than vm->ip and vm->stackTop. Each chunk is compiled the
+ * first time it runs and its code kept with it. Only built for x86-64 Unix;
+ * everywhere else jitCompile() always returns NULL and the interpreter is
+ * used. */
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED
+#endif
+
+// A runtime error was already reported from JIT code.
+#define JIT_RUNTIME_ERROR (-1)
+// A call or return moved to another chunk; vm->ip says where to go on.
+#define JIT_SWITCHED (-2)
+
+JitCode* jitCompile(Chunk* chunk, const char* name);
+/* Runs the code from bytecode offset `offset` of vm->chunk. Returns
+ * JIT_RUNTIME_ERROR, JIT_SWITCHED or the offset the interpreter must go on from, which
+ * is `offset` itself if the instruction there wasn't compiled. */
+int jitExecute(VM* vm, JitCode* code, int offset);
+void jitFree(JitCode* code);
+
+#endif //CLOX_JIT_H
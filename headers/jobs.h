@@ -0,0 +1,13 @@
+#ifndef CLOX_JOBS_H
+#define CLOX_JOBS_H
+
+#include "vm.h"
+
+/* Runs independent scripts on a pool of threads, each in a VM of its own
+ * set up with the same options as `config`. The VMs intern their strings
+ * in one shared table. Every script's output and errors are buffered and
+ * written out in the order the scripts were given.
+ * Returns the exit code of the first script that failed, or 0. */
+int runJobs(const VM* config, bool stats, const char** paths, int count, int threads);
+
+#endif //CLOX_JOBS_H
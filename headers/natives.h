@@ -0,0 +1,36 @@
+#ifndef CLOX_NATIVES_H
+#define CLOX_NATIVES_H
+
+#include "vm.h"
+
+/* The built-in functions:
+ *   clock()            seconds from a monotonic high-resolution clock
+ *   len(string|list|map) length in bytes, or number of items or entries
+ *   append(list, value) adds to the end in amortized O(1), returns the list
+ *   parseNumber(string) the number it spells out, or nil
+ *   map(), map(capacity) an empty map, with room for `capacity` entries
+ *   has(map, key), remove(map, key)
+ *                      whether the key is there (remove() deletes it first)
+ *   keys(map), values(map)
+ *                      a list of them, both in the same order
+ *   sum(list), min(list), max(list), dot(a, b)
+ *                      reductions over lists of numbers; min/max of [] is nil
+ *   add(a, b), scale(list, factor)
+ *                      elementwise, into a new list
+ *   sort(list)         numbers or strings, in place; returns the list
+ *   fiber(fn), spawn(fn[, v])
+ *                      a fiber that will run fn; spawn() queues it to run
+ *                      fn(v) once the script yields, waits or finishes
+ *   resume(fiber[, v]) runs it until it yields or returns, and gives back
+ *                      that value; v is what its yield() (or fn) gets
+ *   yield([v])         hands v to whoever resumed this fiber, or with
+ *                      nobody to hand it to, lets the queued fibers run
+ *   isDone(fiber)      whether its function has returned
+ *   openFile, pipe, listenUnix, connectUnix, listenTcp, connectTcp,
+ *   localPort, accept, read, write, close
+ *                      non-blocking I/O on file descriptors, see io.c
+ * Defined after anything that replaces the VM's globals or string table
+ * (loading an image, sharing an intern table). */
+void defineCoreNatives(VM* vm);
+
+#endif //CLOX_NATIVES_H
@@ -0,0 +1,19 @@
+#ifndef CLOX_NUMBER_H
+#define CLOX_NUMBER_H
+
+#include "common.h"
+
+// Long enough for any double formatted by formatNumber(), with its NUL.
+#define NUMBER_BUFFER_SIZE 32
+
+/* Writes the shortest digits that read back as `number` (Grisu2, which is
+ * shortest for all but a tiny fraction of doubles and always round-trips),
+ * laid out like %g: exponent form below 1e-4 and from 1e17 up. Integral
+ * doubles below 2^53 take a fast path. Returns the length written. */
+int formatNumber(double number, char* buffer);
+
+/* Parses [-]digits[.digits][(e|E)[+|-]digits] or [-]0x<hex digits>, all of
+ * `length` bytes, correctly rounded. Returns false if that isn't a number. */
+bool parseNumber(const char* start, int length, double* result);
+
+#endif //CLOX_NUMBER_H
@@ -2,16 +2,43 @@
 #define CLOX_OBJECT_H
 
 #include "common.h"
+#include "chunk.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType((value), OBJ_BOUND_METHOD)
+#define IS_CLASS(value) isObjType((value), OBJ_CLASS)
+#define IS_FIBER(value) isObjType((value), OBJ_FIBER)
+#define IS_FUNCTION(value) isObjType((value), OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType((value), OBJ_INSTANCE)
+#define IS_LIST(value) isObjType((value), OBJ_LIST)
+#define IS_MAP(value) isObjType((value), OBJ_MAP)
+#define IS_NATIVE(value) isObjType((value), OBJ_NATIVE)
 #define IS_STRING(value) isObjType((value), OBJ_STRING)
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
+    OBJ_BOUND_METHOD,
+    OBJ_CLASS,
+    OBJ_FIBER,
+    OBJ_FUNCTION,
+    OBJ_INSTANCE,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
 } ObjectType;
 
@@ -27,14 +54,184 @@ struct ObjString {
     uint32_t hash;
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
+typedef struct {
+    Obj Obj;
+    int arity;
+    Chunk chunk;
+    ObjString* name;
+    // The class a method was declared in, where `super` starts looking.
+    struct ObjClass* owner;
+} ObjFunction;
+
+/* One active call. Its slots are a window onto its fiber's value stack, so a
+ * call allocates nothing unless the stack has to grow. The script's frame
+ * has no function. */
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+    // The caller's resume point, saved when this frame calls another.
+    uint8_t* ip;
+    Value* slots;
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW,
+    // In the VM's run queue.
+    FIBER_READY,
+    FIBER_RUNNING,
+    // Yielded to the fiber that resumed it, waiting for the next resume().
+    FIBER_SUSPENDED,
+    // Inside resume(), waiting for the fiber it resumed to yield or finish.
+    FIBER_WAITING,
+    // Parked on a descriptor, see io.h.
+    FIBER_BLOCKED,
+    FIBER_DONE,
+} FiberState;
+
+/* A coroutine: a call stack of its own, started on a function and switched
+ * to and from with resume() and yield(). Both stacks start out just big
+ * enough for that function and grow on demand, so an idle fiber costs
+ * little more than its locals. While a fiber runs, the VM keeps its live
+ * registers (ip, stack top, frame count) and these fields are stale. */
+typedef struct ObjFiber {
+    Obj Obj;
+    FiberState state;
+    ObjFunction* function;
+    Value* stack;
+    int stackCapacity;
+    Value* stackTop;
+    CallFrame* frames;
+    int frameCapacity;
+    int frameCount;
+    // Who resumed it and gets control back when it yields or finishes.
+    struct ObjFiber* caller;
+    // The next fiber in the run queue.
+    struct ObjFiber* next;
+} ObjFiber;
+
+/* A hidden class. Instances given the same fields in the same order share a
+ * shape, which says where each field sits in their flat `fields` array.
+ * Setting a new field moves an instance to a child shape, made once per
+ * field name and kept in `transitions`. Every class has its own root shape,
+ * so a shape also pins down the instance's class and methods. */
+struct ObjShape {
+    Obj Obj;
+    ObjShape* parent;
+    // The field this shape adds to its parent's; NULL for a root shape.
+    ObjString* name;
+    int fieldCount;
+    Table transitions;
+};
+
+typedef struct ObjClass {
+    Obj Obj;
+    ObjString* name;
+    struct ObjClass* superclass;
+    // Inherited methods are copied down, so this is the only table to search.
+    Table methods;
+    ObjFunction* initializer;
+    ObjShape* shape;
+    // The most fields an instance has had, to size new ones.
+    int fieldHint;
+} ObjClass;
+
+typedef struct {
+    Obj Obj;
+    ObjClass* klass;
+    ObjShape* shape;
+    int capacity;
+    Value* fields;
+} ObjInstance;
+
+typedef struct {
+    Obj Obj;
+    Value receiver;
+    ObjFunction* method;
+} ObjBoundMethod;
+
+/* While every item is a number, a list is packed: its items are stored
+ * unboxed in `numbers`, ready for the bulk natives. Storing anything else
+ * unpacks it into `items` for good. */
+typedef struct {
+    Obj Obj;
+    bool packed;
+    NumberArray numbers;
+    ValueArray items;
+} ObjList;
+
+/* Keys can be anything but nil and NaN. The table's own count includes
+ * tombstones, so the map keeps the number of live entries itself. */
+typedef struct {
+    Obj Obj;
+    Table table;
+    int count;
+} ObjMap;
+
+/* A C function callable from Lox. It gets the arguments in place on the VM
+ * stack and stores its result in args[-1], the callee's slot. On failure it
+ * reports a runtimeError() and returns false. */
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+typedef struct {
+    Obj Obj;
+    NativeFn function;
+    // -1 for any number of arguments.
+    int arity;
+    ObjString* name;
+    // Whether it can return on another fiber, see callValue().
+    bool switchesFiber;
+} ObjNative;
+
+// Frees every object the VM allocated.
+void freeObjects(VM* vm);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjFunction* method);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjFiber* newFiber(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+// The index of field `name` in instances of `shape`, or -1.
+int shapeField(ObjShape* shape, ObjString* name);
+// The shape instances of `shape` move to when `name` is set on them.
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name);
+// Moves an instance to a child of its shape, making room for the new field.
+void reshapeInstance(VM* vm, ObjInstance* instance, ObjShape* shape);
+ObjList* newList(VM* vm);
+void listAppend(VM* vm, ObjList* list, Value value);
+void listSet(VM* vm, ObjList* list, int index, Value value);
+ObjMap* newMap(VM* vm);
+void mapSet(VM* vm, ObjMap* map, Value key, Value value);
+bool mapDelete(ObjMap* map, Value key);
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b);
 
 static inline bool isObjType(Value value, ObjectType type){
 //    return IS_OBJ(value) && AS_OBJ(value)->type == type;
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
-void printObject(Value value);
+static inline int listCount(ObjList* list){
+    return list->packed ? list->numbers.count : list->items.count;
+}
+
+static inline Value listGet(ObjList* list, int index){
+    return list->packed ? NUMBER_VAL(list->numbers.values[index]) : list->items.values[index];
+}
+
+/* A list or map being printed, linked to the one it's nested in, so that
+ * one holding itself prints as [...] or {...} instead of without end. */
+typedef struct Printing {
+    Obj* object;
+    struct Printing* outer;
+} Printing;
+
+static inline bool isPrinting(Printing* printing, Obj* object){
+    for (; printing != NULL; printing = printing->outer)
+        if (printing->object == object) return true;
+    return false;
+}
+
+void printObject(FILE* out, Value value);
 
 #endif //CLOX_OBJECT_H
@@ -0,0 +1,36 @@
+#ifndef CLOX_OUTPUT_H
+#define CLOX_OUTPUT_H
+
+#include <stdio.h>
+
+#include "value.h"
+
+/* What `print` writes goes through a buffer owned by the VM and reaches the
+ * FILE in one fwrite per flush, instead of a locked stdio call (and a
+ * printf("%g")) for every value. */
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+typedef enum {
+    FLUSH_LINE,     // After every print.
+    FLUSH_FULL,     // When the buffer fills.
+    FLUSH_EXIT,     // Only when flushed explicitly; the buffer grows as needed.
+} FlushPolicy;
+
+typedef struct {
+    FILE* file;
+    FlushPolicy policy;
+    char* buffer;
+    size_t count;
+    size_t capacity;
+} Output;
+
+// Line flushing for terminals, like stdio, and full buffering otherwise.
+void initOutput(Output* output, FILE* file);
+void freeOutput(Output* output);
+void writeOutput(Output* output, const char* bytes, size_t length);
+void printOutput(Output* output, Value value);
+// Hands everything buffered to the FILE and flushes that too.
+void flushOutput(Output* output);
+
+#endif //CLOX_OUTPUT_H
@@ -0,0 +1,44 @@
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+
+/* A VM's worker threads for data-parallel natives. A batch is a number of
+ * independent tasks; the calling thread works on them too and returns once
+ * all are done. Tasks only ever see the plain data handed to them, never
+ * the VM. Threads are started on the first batch that needs them, so VMs
+ * that never run one cost nothing. */
+
+typedef void (*PoolTask)(void* context, int task);
+
+typedef struct {
+    // Worker threads besides the calling one; 0 runs every batch inline.
+    int size;
+    int started;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+
+    // The current batch.
+    PoolTask function;
+    void* context;
+    int taskCount;
+    atomic_int nextTask;
+    int running;
+    uint64_t batch;
+    bool stopping;
+} WorkerPool;
+
+// Defaults to one thread per online core.
+int defaultPoolSize();
+void initWorkerPool(WorkerPool* pool, int size);
+void freeWorkerPool(WorkerPool* pool);
+void runTasks(WorkerPool* pool, int taskCount, PoolTask function, void* context);
+// In a child after fork(): the threads didn't come along, so start afresh.
+void forgetWorkerPool(WorkerPool* pool);
+
+#endif //CLOX_POOL_H
@@ -4,9 +4,9 @@
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
-    //TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-    TOKEN_COMMA, TOKEN_DOT, TOKEN_SEMICOLON,
+    TOKEN_COMMA, TOKEN_DOT, TOKEN_SEMICOLON, TOKEN_COLON,
     TOKEN_PLUS, TOKEN_MINUS, TOKEN_STAR, TOKEN_SLASH,
 
     // Comparison tokens.
@@ -22,6 +22,7 @@ typedef enum {
     TOKEN_AND, TOKEN_OR, TOKEN_TRUE, TOKEN_FALSE,
     TOKEN_FOR, TOKEN_WHILE,
     TOKEN_IF, TOKEN_ELSE,
+    TOKEN_SWITCH, TOKEN_CASE, TOKEN_DEFAULT,
     TOKEN_FUN, TOKEN_RETURN,
     TOKEN_CLASS, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_VAR, TOKEN_PRINT,
@@ -36,7 +37,13 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif //CLOX_SCANNER_H
@@ -0,0 +1,14 @@
+#ifndef CLOX_SERVE_H
+#define CLOX_SERVE_H
+
+#include "vm.h"
+
+/* Listens on a Unix socket and forks a child per connection. The child
+ * inherits the VM as the server left it (globals, interned strings) through
+ * copy-on-write, reads a script from the connection until the client shuts
+ * down its write side, and runs it with output and errors sent back over the
+ * connection. Each child reports its fork-to-first-instruction latency on
+ * the server's stderr. Only returns if the socket can't be set up. */
+void serveForks(VM* vm, const char* socketPath);
+
+#endif //CLOX_SERVE_H
@@ -0,0 +1,14 @@
+#ifndef CLOX_STREAM_H
+#define CLOX_STREAM_H
+
+#include "vm.h"
+
+/* Runs a script one top-level declaration at a time: each is compiled,
+ * executed and freed before the next is read, so memory stays proportional
+ * to the largest declaration rather than the file, and output starts right
+ * away. A declaration ends at a `;` or `}` outside any brackets, unless an
+ * `else` follows. Stops at the first compile or runtime error, or at a read
+ * error, which is reported through `readFailed`. */
+InterpretResult interpretStream(VM* vm, int fd, bool* readFailed);
+
+#endif //CLOX_STREAM_H
@@ -5,16 +5,35 @@
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+#define TABLE_PROBE_BUCKETS 16
 
+/* Keys are strings for the VM's own tables; maps can also use numbers,
+ * booleans and other objects (by identity). A nil key marks a free slot:
+ * empty with a nil value, a tombstone with `true`. */
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
+#ifdef DEBUG_STATS
+typedef struct {
+    uint64_t lookups;
+    uint64_t probes;
+    // probeHistogram[n] counts lookups that took n + 1 probes; the last bucket is open-ended.
+    uint64_t probeHistogram[TABLE_PROBE_BUCKETS];
+    int maxProbes;
+    int tombstones;
+    int resizes;
+} TableStats;
+#endif
+
 typedef struct {
     int count;
     int capacity;
     Entry* entries;
+#ifdef DEBUG_STATS
+    TableStats stats;
+#endif
 } Table;
 
 void initTable(Table* table);
@@ -23,6 +42,15 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
+// The same for any key but nil. NaN keys can be stored but never found.
+bool tableGetValue(Table* table, Value key, Value* value);
+bool tableSetValue(Table* table, Value key, Value value);
+bool tableDeleteValue(Table* table, Value key);
+// Sizes an empty table so `count` keys fit without growing.
+void tableReserve(Table* table, int count);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+#ifdef DEBUG_STATS
+void printTableStats(FILE* out, const char* name, Table* table);
+#endif
 
 #endif //CLOX_TABLE_H
@@ -0,0 +1,28 @@
+#ifndef CLOX_TIMELINE_H
+#define CLOX_TIMELINE_H
+
+#include "common.h"
+
+/* A process-wide ring buffer of timestamped events, dumped in the Chrome
+ * trace event format (chrome://tracing, ui.perfetto.dev). Recording is
+ * compiled out entirely unless DEBUG_TIMELINE is defined. */
+
+#define TIMELINE_CAPACITY (1 << 16)
+
+#ifdef DEBUG_TIMELINE
+#define TIMELINE_BEGIN(name) timelineRecord((name), 'B', 0)
+#define TIMELINE_END(name) timelineRecord((name), 'E', 0)
+#define TIMELINE_INSTANT(name, value) timelineRecord((name), 'i', (value))
+#else
+#define TIMELINE_BEGIN(name) ((void) 0)
+#define TIMELINE_END(name) ((void) 0)
+#define TIMELINE_INSTANT(name, value) ((void) 0)
+#endif
+
+void timelineRecord(const char* name, char phase, int64_t value);
+// Monotonic nanoseconds; recorded events are stamped with it. Always available.
+int64_t timelineClock();
+bool timelineDump(const char* path);
+void installTimelineSignal(const char* path);
+
+#endif //CLOX_TIMELINE_H
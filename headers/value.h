@@ -1,10 +1,13 @@
 #ifndef CLOX_VALUE_H
 #define CLOX_VALUE_H int x = 5;
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
 
 typedef enum {
     VAL_BOOL,
@@ -45,11 +48,22 @@ typedef struct {
     Value* values;
 } ValueArray;
 
+// Unboxed numbers, for lists that hold nothing else.
+typedef struct {
+    int count;
+    int capacity;
+    double* values;
+} NumberArray;
+
 bool isFalsey(Value value);
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+void initNumberArray(NumberArray* array);
+void writeNumberArray(NumberArray* array, double number);
+void freeNumberArray(NumberArray* array);
 void printValue(Value value);
+void fprintValue(FILE* out, Value value);
 
 #endif
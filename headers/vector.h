@@ -0,0 +1,21 @@
+#ifndef CLOX_VECTOR_H
+#define CLOX_VECTOR_H
+
+#include "common.h"
+
+/* Kernels over arrays of doubles, for the bulk list natives. They use SSE2
+ * where the compiler targets it (always on x86-64) and plain loops
+ * elsewhere. Sums are accumulated in several lanes, so they can round
+ * differently from a left-to-right loop. */
+
+double sumNumbers(const double* numbers, int count);
+// Both expect count > 0. NaNs are skipped unless every number is one.
+double minNumbers(const double* numbers, int count);
+double maxNumbers(const double* numbers, int count);
+double dotNumbers(const double* a, const double* b, int count);
+void addNumbers(double* result, const double* a, const double* b, int count);
+void scaleNumbers(double* result, const double* numbers, double factor, int count);
+// Ascending, with NaNs last.
+void sortNumbers(double* numbers, int count);
+
+#endif //CLOX_VECTOR_H
@@ -3,18 +3,71 @@
 
 #include "chunk.h"
 #include "table.h"
+#include "intern.h"
+#include "cache.h"
+#include "output.h"
+#include "object.h"
+#include "pool.h"
+#include "io.h"
 
-#define STACK_MAX 256
+/* How deep a fiber's stacks can grow. Both grow on demand, so these only
+ * stop runaway recursion: 64K frames of 16 slots on average. */
+#define FRAMES_MAX 65536
+#define STACK_MAX (FRAMES_MAX * 16)
 
-typedef struct {
+struct VM {
+    // The running frame's chunk, ip and slots, kept out of frames[] while it runs.
     Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+    Value* slots;
+    // The running fiber's frames, frame count and stack top, likewise.
+    CallFrame* frames;
+    int frameCount;
     Value* stackTop;
+    ObjFiber* fiber;
+    // The script runs on this one. It isn't on vm->objects and Lox never sees it.
+    ObjFiber mainFiber;
+    // Fibers waiting for a turn, oldest first.
+    ObjFiber* readyHead;
+    ObjFiber* readyTail;
+    // While set, the main fiber finishing a script leaves the queue and
+    // I/O waiters for a later runQueued() instead of draining them.
+    bool holdFibers;
+    IoLoop io;
     Table globals;
     Table strings;
+    // When set, strings are interned here instead of in `strings`.
+    InternTable* sharedStrings;
     Obj* objects;
-} VM;
+    // The heap image the VM was booted from, if any.
+    void* image;
+    size_t imageSize;
+    // Chunks in the image given native code, which freeImage() frees.
+    Chunk** imageJit;
+    int imageJitCount;
+    int imageJitCapacity;
+    ChunkCache chunks;
+    WorkerPool workers;
+
+    bool printCode;
+    bool registerCode;
+    bool jit;
+    bool traceExecution;
+    FILE* traceOut;
+    Output output;
+    FILE* errOut;
+    // Number of SIGUSR1 toggles this VM has already applied.
+    int traceToggleSeen;
+    // When non-zero, the next interpret() reports the time from this
+    // timelineClock() reading to its first instruction on stderr.
+    int64_t startupClock;
+
+#ifdef DEBUG_STATS
+    uint64_t internHits;
+    uint64_t internMisses;
+    uint64_t dispatches;
+#endif
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -22,13 +75,29 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM* vm);
+void freeVM(VM* vm);
+void installTraceSignal();
+void printVMStats(VM* vm, FILE* out);
+InterpretResult interpret(VM* vm, const char* source);
+/* Compiled chunks are cached per VM, so evaluating the same source again
+ * skips the compiler. compileCached() returns a pinned entry (NULL on a
+ * compile error) that can be run any number of times and must be handed back
+ * with releaseCached(&vm->chunks, entry). */
+CachedChunk* compileCached(VM* vm, const char* source);
+InterpretResult interpretCached(VM* vm, CachedChunk* entry);
+InterpretResult interpretChunk(VM* vm, Chunk* chunk);
+// Runs queued fibers and those parked on I/O until none are left.
+InterpretResult runQueued(VM* vm);
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
-void push(Value value);
-Value pop();
+// Makes `function` callable from Lox as the global `name`.
+ObjNative* defineNative(VM* vm, const char* name, NativeFn function, int arity);
+// Reports an error at the current instruction and unwinds the stack.
+void runtimeError(VM* vm, const char* format, ...);
+// Calls the value below the top `argCount` stack slots with them as arguments.
+bool callValue(VM* vm, Value callee, int argCount);
 
 #endif
@@ -1,8 +1,19 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "vm.h"
+#include "timeline.h"
+#include "jit.h"
+#include "jobs.h"
+#include "serve.h"
+#include "image.h"
+#include "stream.h"
+#include "natives.h"
+
+static VM vm;
 
 static void repl(){
     printf("CLOX\n");
@@ -15,7 +26,8 @@ static void repl(){
             break;
         }
 
-        interpret(line);
+        interpret(&vm, line);
+        flushOutput(&vm.output);
     }
 }
 
@@ -49,27 +61,175 @@ static char* readFile(const char* path){
 
 static void runFile(const char* path){
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(&vm, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void streamFile(const char* path){
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s.\n", path);
+        exit(74);
+    }
+
+    bool readFailed;
+    InterpretResult result = interpretStream(&vm, fd, &readFailed);
+    if (readFailed) {
+        fprintf(stderr, "Could not read file %s.\n", path);
+        exit(74);
+    }
+    if (fd != STDIN_FILENO) close(fd);
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Output is still buffered in the VM when main() exits early.
+static void flushAtExit(){
+    flushOutput(&vm.output);
+}
+
+static FlushPolicy parseFlushPolicy(const char* name){
+    if (strcmp(name, "line") == 0) return FLUSH_LINE;
+    if (strcmp(name, "full") == 0) return FLUSH_FULL;
+    if (strcmp(name, "exit") == 0) return FLUSH_EXIT;
+    fprintf(stderr, "Unknown flush policy %s; expected line, full or exit.\n", name);
+    exit(64);
+}
+
+static void usage(){
+    fprintf(stderr, "Usage: clox [--trace] [--disassemble] [--registers] [--jit] [--trace-file path] [--timeline path] [--stats] [--report-startup]\n"
+                    "            [--flush line|full|exit] [--threads N] [--image path] [--snapshot path] [--prelude path]\n"
+                    "            [path | --stream path | --jobs N path... | --serve socket]\n");
+    exit(64);
+}
+
+static FILE* openTraceFile(const char* path){
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open trace file %s.\n", path);
+        exit(74);
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    return file;
+}
+
 int main(int argc, char* argv[]){
-    initVM();
+    int64_t started = timelineClock();
+    initVM(&vm);
+    atexit(flushAtExit);
+    installTraceSignal();
+
+    const char** paths = malloc(sizeof(const char*) * argc);
+    int pathCount = 0;
+    int jobs = 0;
+    const char* timelinePath = NULL;
+    const char* socketPath = NULL;
+    const char* preludePath = NULL;
+    const char* imagePath = NULL;
+    const char* snapshotPath = NULL;
+    bool reportStartup = false;
+    bool stream = false;
+    bool stats = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0)
+            vm.traceExecution = true;
+        else if (strcmp(argv[i], "--disassemble") == 0)
+            vm.printCode = true;
+        else if (strcmp(argv[i], "--registers") == 0)
+            vm.registerCode = true;
+        else if (strcmp(argv[i], "--jit") == 0) {
+#ifdef JIT_SUPPORTED
+            vm.jit = true;
+#else
+            fprintf(stderr, "Warning: no JIT for this platform, using the interpreter.\n");
+#endif
+        }
+        else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc)
+            vm.traceOut = openTraceFile(argv[++i]);
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = true;
+        else if (strcmp(argv[i], "--timeline") == 0 && i + 1 < argc)
+            timelinePath = argv[++i];
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) usage();
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc)
+            preludePath = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            imagePath = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+            snapshotPath = argv[++i];
+        else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc)
+            vm.output.policy = parseFlushPolicy(argv[++i]);
+        else if (strcmp(argv[i], "--stream") == 0)
+            stream = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            if (threads < 1) usage();
+            vm.workers.size = threads - 1;
+        }
+        else if (strcmp(argv[i], "--report-startup") == 0)
+            reportStartup = true;
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+            usage();
+        else
+            paths[pathCount++] = argv[i];
+    }
+    if (pathCount > 1 && jobs == 0) usage();
+    if (jobs > 0 && (pathCount == 0 || socketPath != NULL || preludePath != NULL)) usage();
+    if (socketPath != NULL && pathCount > 0) usage();
+    if (stream && (pathCount != 1 || jobs > 0)) usage();
+    if (snapshotPath != NULL && (socketPath != NULL || jobs > 0 || imagePath != NULL)) usage();
 
-    if (argc == 1) {
+    if (timelinePath != NULL) {
+#ifndef DEBUG_TIMELINE
+        fprintf(stderr, "Warning: built without DEBUG_TIMELINE, the timeline will be empty.\n");
+#endif
+        installTimelineSignal(timelinePath);
+    }
+
+    if (imagePath != NULL && !loadImage(&vm, imagePath)) exit(74);
+    defineCoreNatives(&vm);
+    // With --serve the prelude runs once and every forked child starts from its globals.
+    if (preludePath != NULL) runFile(preludePath);
+    if (reportStartup) vm.startupClock = started;
+
+    int exitCode = 0;
+    if (socketPath != NULL) {
+        serveForks(&vm, socketPath);
+        exit(74);
+    }
+    else if (jobs > 0) {
+        exitCode = runJobs(&vm, stats, paths, pathCount, jobs);
+    }
+    else if (pathCount == 0) {
         repl();
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+    else if (stream) {
+        streamFile(paths[0]);
     }
     else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(paths[0]);
     }
 
-    freeVM();
-    return 0;
+    if (snapshotPath != NULL && !saveImage(&vm, snapshotPath)) exit(74);
+    if (stats && jobs == 0) {
+        flushOutput(&vm.output);
+        printVMStats(&vm, stderr);
+    }
+    if (vm.traceOut != stdout) fclose(vm.traceOut);
+    freeVM(&vm);
+    free(paths);
+    if (timelinePath != NULL && !timelineDump(timelinePath)) {
+        fprintf(stderr, "Could not write timeline %s.\n", timelinePath);
+        exit(74);
+    }
+    return exitCode;
 }
@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "cache.h"
+#include "memory.h"
+
+void initChunkCache(ChunkCache* cache, int capacity){
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->count = 0;
+    cache->capacity = capacity;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+static uint64_t hashSource(const char* source, int length, bool registerCode){
+    // 64-bit FNV-1a; hits are confirmed against the stored source anyway.
+    uint64_t hash = 14695981039346656037ull ^ registerCode;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static CachedChunk** bucketFor(ChunkCache* cache, uint64_t hash){
+    return &cache->buckets[hash & (CHUNK_CACHE_BUCKETS - 1)];
+}
+
+static void unlinkRecent(ChunkCache* cache, CachedChunk* entry){
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+static void linkNewest(ChunkCache* cache, CachedChunk* entry){
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL) cache->newest->newer = entry;
+    cache->newest = entry;
+    if (cache->oldest == NULL) cache->oldest = entry;
+}
+
+static void freeEntry(CachedChunk* entry){
+    freeChunk(&entry->chunk);
+    FREE_ARRAY(char, entry->source, entry->length + 1);
+    FREE(CachedChunk, entry);
+}
+
+static void removeEntry(ChunkCache* cache, CachedChunk* entry){
+    CachedChunk** link = bucketFor(cache, entry->hash);
+    while (*link != entry) link = &(*link)->nextInBucket;
+    *link = entry->nextInBucket;
+    unlinkRecent(cache, entry);
+    cache->count--;
+    entry->cached = false;
+    if (entry->pins == 0) freeEntry(entry);
+}
+
+CachedChunk* findCached(ChunkCache* cache, const char* source, int length, bool registerCode){
+    uint64_t hash = hashSource(source, length, registerCode);
+    for (CachedChunk* entry = *bucketFor(cache, hash); entry != NULL; entry = entry->nextInBucket) {
+        if (entry->hash == hash && entry->length == length
+            && entry->registerCode == registerCode
+            && memcmp(entry->source, source, length) == 0) {
+            unlinkRecent(cache, entry);
+            linkNewest(cache, entry);
+            entry->pins++;
+            cache->hits++;
+            return entry;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+CachedChunk* addCached(ChunkCache* cache, const char* source, int length, bool registerCode){
+    // Pinned entries can't go, so a cache full of them grows past its capacity.
+    CachedChunk* victim = cache->oldest;
+    while (cache->count >= cache->capacity && victim != NULL) {
+        CachedChunk* newer = victim->newer;
+        if (victim->pins == 0) removeEntry(cache, victim);
+        victim = newer;
+    }
+
+    CachedChunk* entry = ALLOCATE(CachedChunk, 1);
+    entry->hash = hashSource(source, length, registerCode);
+    entry->source = ALLOCATE(char, length + 1);
+    memcpy(entry->source, source, length);
+    entry->source[length] = '\0';
+    entry->length = length;
+    entry->registerCode = registerCode;
+    initChunk(&entry->chunk);
+    entry->pins = 1;
+    entry->cached = true;
+
+    CachedChunk** bucket = bucketFor(cache, entry->hash);
+    entry->nextInBucket = *bucket;
+    *bucket = entry;
+    linkNewest(cache, entry);
+    cache->count++;
+    return entry;
+}
+
+void releaseCached(ChunkCache* cache, CachedChunk* entry){
+    entry->pins--;
+    if (entry->pins == 0 && !entry->cached) freeEntry(entry);
+}
+
+void invalidateCached(ChunkCache* cache, CachedChunk* entry){
+    if (entry->cached) removeEntry(cache, entry);
+}
+
+void clearChunkCache(ChunkCache* cache){
+    while (cache->oldest != NULL) removeEntry(cache, cache->oldest);
+}
+
+void freeChunkCache(ChunkCache* cache){
+    // The VM is going away, so pinned entries go too.
+    while (cache->oldest != NULL) {
+        CachedChunk* entry = cache->oldest;
+        entry->pins = 0;
+        removeEntry(cache, entry);
+    }
+}
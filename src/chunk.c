@@ -1,5 +1,8 @@
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
 #include "value.h"
 
@@ -9,6 +12,12 @@ void initChunk(Chunk* chunk){
     chunk -> code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->caches = NULL;
+    chunk->switchCount = 0;
+    chunk->switches = NULL;
+    chunk->maxStack = 0;
+    chunk->jit = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line){
@@ -34,6 +43,14 @@ void freeChunk(Chunk* chunk){
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCount);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        SwitchTable* table = &chunk->switches[i];
+        FREE_ARRAY(int, table->offsets, table->count);
+        freeTable(&table->cases);
+    }
+    FREE_ARRAY(SwitchTable, chunk->switches, chunk->switchCount);
+    if (chunk->jit != NULL) jitFree(chunk->jit);
     initChunk(chunk);
 }
 
@@ -41,3 +58,171 @@ int addConstant(Chunk* chunk, Value value){
     writeValueArray(&chunk->constants, value);
     return  chunk->constants.count - 1;
 }
+
+int addCache(Chunk* chunk){
+    // Grown one at a time: compiling is rare next to running.
+    int count = chunk->cacheCount + 1;
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, chunk->cacheCount, count);
+    memset(&chunk->caches[chunk->cacheCount], 0, sizeof(InlineCache));
+    return chunk->cacheCount++;
+}
+
+int addSwitch(Chunk* chunk){
+    int count = chunk->switchCount + 1;
+    chunk->switches = GROW_ARRAY(SwitchTable, chunk->switches, chunk->switchCount, count);
+    SwitchTable* table = &chunk->switches[chunk->switchCount];
+    table->dense = false;
+    table->low = 0;
+    table->count = 0;
+    table->offsets = NULL;
+    initTable(&table->cases);
+    table->defaultOffset = 0;
+    return chunk->switchCount++;
+}
+
+int instructionLength(uint8_t instruction){
+    switch (genericOpcode(instruction)) {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SWITCH:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_EQUAL_RK:
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_ADD_RK_SET:
+        case OP_SUBTRACT_RK_SET:
+        case OP_MULTIPLY_RK_SET:
+        case OP_DIVIDE_RK_SET:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+uint8_t genericOpcode(uint8_t instruction){
+    switch (instruction) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:        return OP_ADD;
+        case OP_SUBTRACT_NUM:   return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:   return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:     return OP_DIVIDE;
+        case OP_GREATER_NUM:    return OP_GREATER;
+        case OP_LESS_NUM:       return OP_LESS;
+        default:                return instruction;
+    }
+}
+
+// What the instruction at `code` pushes, less what it pops.
+static int stackEffect(const uint8_t* code){
+    switch (genericOpcode(code[0])) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_CLASS:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_EQUAL_RK:
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+            return 1;
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_GREATER_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_GET_INDEX:
+        case OP_METHOD:
+        case OP_SET_PROPERTY:
+        case OP_SWITCH:
+        case OP_RETURN:
+            return -1;
+        case OP_SET_INDEX:
+        case OP_INHERIT:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return -code[2];
+        case OP_BUILD_LIST:
+            return 1 - code[1];
+        case OP_BUILD_MAP:
+            return 1 - 2 * code[1];
+        default:
+            return 0;
+    }
+}
+
+/* One pass in code order. Forward jumps record the depth at their target,
+ * which is what the code there starts from: a loop's exit still has the
+ * condition on the stack while the body above it has popped it. Backward
+ * jumps return to a depth already seen. */
+int maxStackDepth(Chunk* chunk, int depth){
+    int count = chunk->count + 1;
+    int* targets = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++) targets[i] = -1;
+
+    int max = depth;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        if (targets[offset] != -1) depth = targets[offset];
+        uint8_t* code = &chunk->code[offset];
+        depth += stackEffect(code);
+        if (depth > max) max = depth;
+
+        uint8_t instruction = genericOpcode(code[0]);
+        if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE) {
+            int target = offset + 3 + (uint16_t) ((code[1] << 8) | code[2]);
+            if (target < count) targets[target] = depth;
+        }
+    }
+    FREE_ARRAY(int, targets, count);
+    return max;
+}
+
+// Restores the bytecode exactly as the compiler emitted it.
+void unquickenChunk(Chunk* chunk){
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        chunk->code[offset] = genericOpcode(chunk->code[offset]);
+    }
+}
@@ -6,17 +6,15 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "object.h"
-
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
+#include "memory.h"
+#include "timeline.h"
+#include "number.h"
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
+// A switch on whole numbers between -SWITCH_NUMBER_MAX and SWITCH_NUMBER_MAX
+// gets an array when it spans at most twice its case count, or this many.
+#define SWITCH_DENSE_MIN 8
+#define SWITCH_NUMBER_MAX 1e9
 
 typedef enum {
     PREC_NONE,
@@ -32,7 +30,9 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef struct Parser Parser;
+
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -40,65 +40,112 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+/* What the compiler can prove about a value. Only numbers are tracked, to
+ * emit the _UNCHECKED arithmetic opcodes. */
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+} ExprType;
+
 typedef struct {
     Token name;
     int depth;
+    ExprType type;
 } Local;
 
-typedef struct {
+typedef enum {
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
+    TYPE_SCRIPT,
+} FunctionType;
+
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    // NULL for the script, which compiles straight into the caller's chunk.
+    ObjFunction* function;
+    FunctionType type;
+    Chunk* chunk;
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+    // Start of the left operand of the infix expression being compiled.
+    int operandStart;
+    // Latest offset a forward jump lands on; code before it can't be fused.
+    int lastLabel;
+    // Type of the expression compiled last.
+    ExprType exprType;
+    int loopDepth;
+    // Start of the outermost loop being compiled, where a back edge can
+    // carry values into code compiled earlier.
+    int outerLoopStart;
+    // End of the last call emitted, for turning `return f();` into a tail call.
+    int lastCall;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
+typedef struct ClassCompiler {
+    struct ClassCompiler* enclosing;
+    bool hasSuperclass;
+} ClassCompiler;
 
-static Chunk* currentChunk(){
-    return compilingChunk;
+/* Everything one compile() call works on, so independent VMs can compile
+ * on different threads at the same time. */
+struct Parser {
+    VM* vm;
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    Compiler* compiler;
+    ClassCompiler* currentClass;
+};
+
+static Chunk* currentChunk(Parser* parser){
+    return parser->compiler->chunk;
 }
 
-static void advance();
+static void advance(Parser* parser);
 
 /*********   Error Handling   *********/
 
-static void errorAt(Token* token, const char* msg){
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d]", token->line);
+static void errorAt(Parser* parser, Token* token, const char* msg){
+    if (parser->panicMode) return;
+    parser->panicMode = true;
+    fprintf(parser->vm->errOut, "[line %d]", token->line);
 
     if (token->type == TOKEN_EOF)
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->errOut, " at end");
     else if (token->type == TOKEN_ERROR){
         //nothing
     }
     else
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
-    fprintf(stderr, ": %s\n", msg);
-    parser.hadError = true;
+        fprintf(parser->vm->errOut, " at '%.*s'", token->length, token->start);
+    fprintf(parser->vm->errOut, ": %s\n", msg);
+    parser->hadError = true;
 }
 
-static void error(const char* msg){
-    errorAt(&parser.previous, msg);
+static void error(Parser* parser, const char* msg){
+    errorAt(parser, &parser->previous, msg);
 }
 
-static void errorAtCurrent(const char * msg){
-    errorAt(&parser.current, msg);
+static void errorAtCurrent(Parser* parser, const char * msg){
+    errorAt(parser, &parser->current, msg);
 }
 
-static void synchronize(){
-    parser.panicMode = false;
+static void synchronize(Parser* parser){
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_WHILE:
             case TOKEN_IF:
+            case TOKEN_SWITCH:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
                 return;
@@ -107,7 +154,7 @@ static void synchronize(){
                 ; // Do nothing.
         }
 
-        advance();
+        advance(parser);
     }
 }
 
@@ -115,10 +162,10 @@ static void synchronize(){
 
 /*********     Conversion     *********/
 
-static uint8_t makeConstant(Value value){
-    int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value){
+    int constant = addConstant(currentChunk(parser), value);
     if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t) constant;
@@ -128,89 +175,101 @@ static uint8_t makeConstant(Value value){
 
 /*********      Parssing      *********/
 
-static void advance(){
-    parser.previous = parser.current;
+static void advance(Parser* parser){
+    parser->previous = parser->current;
 
     while (true) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* msg){
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* msg){
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(msg);
+    errorAtCurrent(parser, msg);
 }
 
-static bool check(TokenType type){
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type){
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type){
-    if (!check(type)) return false;
+static bool match(Parser* parser, TokenType type){
+    if (!check(parser, type)) return false;
 
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte){
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte){
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2){
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2){
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitReturn(){
-    emitByte(OP_RETURN);
+static void emitReturn(Parser* parser){
+    // The script's OP_RETURN just stops the VM; functions return nil and
+    // initializers the instance.
+    if (parser->compiler->type == TYPE_INITIALIZER) emitBytes(parser, OP_GET_LOCAL, 0);
+    else if (parser->compiler->type != TYPE_SCRIPT) emitByte(parser, OP_NIL);
+    emitByte(parser, OP_RETURN);
 }
 
-static void emitConstant(Value value){
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitCache(Parser* parser){
+    int cache = addCache(currentChunk(parser));
+    if (cache > UINT16_MAX) error(parser, "Too many property accesses in one chunk.");
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
 }
 
-static void emitLoop(int loopStart){
-    emitByte(OP_LOOP);
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large!");
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+static void emitConstant(Parser* parser, Value value){
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static int emitJump(uint8_t instruction){
-    emitByte(instruction);
-    emitBytes(0xff, 0xff);
-    return currentChunk()->count - 2;
+static void emitLoop(Parser* parser, int loopStart){
+    emitByte(parser, OP_LOOP);
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large!");
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static void patchJump(int offset){
-    int jump = currentChunk()->count -  offset - 2;
+static int emitJump(Parser* parser, uint8_t instruction){
+    emitByte(parser, instruction);
+    emitBytes(parser, 0xff, 0xff);
+    return currentChunk(parser)->count - 2;
+}
+
+static void patchJump(Parser* parser, int offset){
+    int jump = currentChunk(parser)->count -  offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over!");
+        error(parser, "Too much code to jump over!");
 //        return; THINK IT SHOULD RETURN OTHERWISE IT'LL STILL TRY AND FAIL
 //        TO JUMP OVER CODE LONGER THAN IT COULD HANDLE?
     }
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    parser->compiler->lastLabel = currentChunk(parser)->count;
 }
 
-static uint8_t identifierConstant(Token* name){
-    for (int i=0; i<currentChunk()->constants.count; i++){
-        Value* constant = &currentChunk()->constants.values[i];
+static uint8_t identifierConstant(Parser* parser, Token* name){
+    for (int i=0; i<currentChunk(parser)->constants.count; i++){
+        Value* constant = &currentChunk(parser)->constants.values[i];
         if (constant->type == VAL_OBJ
             && constant->as.obj->type == OBJ_STRING
+            && AS_STRING(*constant)->length == name->length
             && memcmp(AS_CSTRING(*constant), name->start, name->length) == 0)
             return i;
     }
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -220,25 +279,183 @@ static bool identifiersEqual(Token* a, Token* b) {
 
 /**************************************/
 
+/*********     Registers      *********/
+
+/* With --registers, binary operations whose operands are both a single local
+ * or constant load are rewritten into one three-address instruction that
+ * reads its operands in place instead of going through the stack. */
+
+static int registerOperand(Parser* parser, int offset, int end){
+    Chunk* chunk = currentChunk(parser);
+    if (end - offset != 2) return -1;
+
+    uint8_t operand = chunk->code[offset + 1];
+    if (operand > REGISTER_MAX) return -1;
+    if (chunk->code[offset] == OP_GET_LOCAL) return operand;
+    if (chunk->code[offset] == OP_CONSTANT) return operand | REGISTER_CONSTANT;
+    return -1;
+}
+
+static bool emitRegisterOp(Parser* parser, TokenType operatorType, int leftStart, int rightStart){
+    if (!parser->vm->registerCode || parser->compiler->lastLabel > leftStart) return false;
+
+    int left = registerOperand(parser, leftStart, rightStart);
+    int right = registerOperand(parser, rightStart, currentChunk(parser)->count);
+    if (left == -1 || right == -1) return false;
+
+    OpCode op;
+    bool negate = false;
+    switch (operatorType) {
+        case TOKEN_PLUS:          op = OP_ADD_RK; break;
+        case TOKEN_MINUS:         op = OP_SUBTRACT_RK; break;
+        case TOKEN_STAR:          op = OP_MULTIPLY_RK; break;
+        case TOKEN_SLASH:         op = OP_DIVIDE_RK; break;
+        case TOKEN_EQUAL_EQUAL:   op = OP_EQUAL_RK; break;
+        case TOKEN_BANG_EQUAL:    op = OP_EQUAL_RK; negate = true; break;
+        case TOKEN_GREATER:       op = OP_GREATER_RK; break;
+        case TOKEN_LESS:          op = OP_LESS_RK; break;
+        case TOKEN_GREATER_EQUAL: op = OP_LESS_RK; negate = true; break;
+        case TOKEN_LESS_EQUAL:    op = OP_GREATER_RK; negate = true; break;
+        default: return false;
+    }
+
+    currentChunk(parser)->count = leftStart;
+    emitByte(parser, op);
+    emitBytes(parser, (uint8_t) left, (uint8_t) right);
+    if (negate) emitByte(parser, OP_NOT);
+    return true;
+}
+
+/* Ends an expression statement. `local = a op b;` collapses into a single
+ * _RK_SET instruction instead of _RK, OP_SET_LOCAL and OP_POP. */
+static void discardExpression(Parser* parser, int start){
+    Chunk* chunk = currentChunk(parser);
+    if (parser->vm->registerCode
+        && parser->compiler->lastLabel <= start
+        && chunk->count - start == 5
+        && chunk->code[start] >= OP_ADD_RK && chunk->code[start] <= OP_DIVIDE_RK
+        && chunk->code[start + 3] == OP_SET_LOCAL) {
+        uint8_t op = chunk->code[start] - OP_ADD_RK + OP_ADD_RK_SET;
+        uint8_t left = chunk->code[start + 1];
+        uint8_t right = chunk->code[start + 2];
+        uint8_t slot = chunk->code[start + 4];
+
+        chunk->code[start] = op;
+        chunk->code[start + 1] = slot;
+        chunk->code[start + 2] = left;
+        chunk->code[start + 3] = right;
+        chunk->count = start + 4;
+        return;
+    }
+    emitByte(parser, OP_POP);
+}
+
+/**************************************/
+
+/*********       Types        *********/
+
+/* A local keeps TYPE_NUMBER while everything assigned to it is a proven
+ * number. Assigning anything else inside a loop may send a non-number back
+ * into code already emitted as unchecked, so that code is rewritten to the
+ * checked opcodes and every local forgets its type. */
+
+static uint8_t checkedOpcode(uint8_t instruction){
+    switch (instruction) {
+        case OP_ADD_UNCHECKED:      return OP_ADD;
+        case OP_SUBTRACT_UNCHECKED: return OP_SUBTRACT;
+        case OP_MULTIPLY_UNCHECKED: return OP_MULTIPLY;
+        case OP_DIVIDE_UNCHECKED:   return OP_DIVIDE;
+        case OP_GREATER_UNCHECKED:  return OP_GREATER;
+        case OP_LESS_UNCHECKED:     return OP_LESS;
+        case OP_NEGATE_UNCHECKED:   return OP_NEGATE;
+        default:                    return instruction;
+    }
+}
+
+static void assignLocalType(Parser* parser, int slot, ExprType type){
+    Local* local = &parser->compiler->locals[slot];
+    if (local->type != TYPE_NUMBER || type == TYPE_NUMBER) return;
+
+    local->type = TYPE_UNKNOWN;
+    if (parser->compiler->loopDepth == 0) return;
+
+    Chunk* chunk = currentChunk(parser);
+    for (int offset = parser->compiler->outerLoopStart; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+        chunk->code[offset] = checkedOpcode(chunk->code[offset]);
+    }
+    for (int i = 0; i < parser->compiler->localCount; i++) {
+        parser->compiler->locals[i].type = TYPE_UNKNOWN;
+    }
+}
+
+static void beginLoop(Parser* parser, int loopStart){
+    if (parser->compiler->loopDepth++ == 0) parser->compiler->outerLoopStart = loopStart;
+}
+
+static void endLoop(Parser* parser){
+    parser->compiler->loopDepth--;
+}
+
+/**************************************/
+
 /*******     Compiler State     *******/
 
-static void initCompiler(Compiler* compiler){
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type, Chunk* chunk){
+    compiler->enclosing = parser->compiler;
+    compiler->function = NULL;
+    compiler->type = type;
+    compiler->chunk = chunk;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->operandStart = 0;
+    compiler->lastLabel = 0;
+    compiler->exprType = TYPE_UNKNOWN;
+    compiler->loopDepth = 0;
+    compiler->outerLoopStart = 0;
+    compiler->lastCall = -1;
+    parser->compiler = compiler;
+
+    if (type != TYPE_SCRIPT) {
+        compiler->function = newFunction(parser->vm);
+        compiler->function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
+        compiler->chunk = &compiler->function->chunk;
+
+        // Slot 0 holds the function being called, or a method's receiver.
+        // The script has no such slot, so its locals start at the bottom of
+        // the stack.
+        Local* local = &compiler->locals[compiler->localCount++];
+        local->name.start = type == TYPE_FUNCTION ? "" : "this";
+        local->name.length = type == TYPE_FUNCTION ? 0 : 4;
+        local->depth = 0;
+        local->type = TYPE_UNKNOWN;
+    }
 }
 
-static void beginScope(){
-    current->scopeDepth++;
+static ObjFunction* endCompiler(Parser* parser){
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    Chunk* chunk = currentChunk(parser);
+    chunk->maxStack = maxStackDepth(chunk, function != NULL ? function->arity + 1 : 0);
+    if(parser->vm->printCode && !parser->hadError) {
+        disassembleChunk(parser->vm->traceOut, currentChunk(parser),
+                         function != NULL ? function->name->chars : "code");
+    }
+    parser->compiler = parser->compiler->enclosing;
+    return function;
+}
+
+static void beginScope(Parser* parser){
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope(){
-    current->scopeDepth--;
+static void endScope(Parser* parser){
+    parser->compiler->scopeDepth--;
 
-    while (current->localCount > 0
-           && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+    while (parser->compiler->localCount > 0
+           && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+        emitByte(parser, OP_POP);
+        parser->compiler->localCount--;
     }
 }
 
@@ -246,13 +463,13 @@ static void endScope(){
 
 /*********     Variables      *********/
 
-static int resolveLocal(Compiler* compiler, Token* name){
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name){
     int i=compiler->localCount-1;
     for (; i>=0; i--) {
         Local* local = &compiler->locals[i];
         if (identifiersEqual(&local->name, name)) {
             if (local->depth == -1)
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             break;
 //            return i;
         }
@@ -260,179 +477,337 @@ static int resolveLocal(Compiler* compiler, Token* name){
     return i; // should be return -1;
 }
 
-static void addLocal(Token name){
-    if (current->localCount > UINT8_COUNT) {
-        error("Too many local variables in scope.");
+static void addLocal(Parser* parser, Token name){
+    if (parser->compiler->localCount > UINT8_COUNT) {
+        error(parser, "Too many local variables in scope.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
+    local->type = TYPE_UNKNOWN;
 }
 
-static void declareVariable(){
-    Token* name = &parser.previous;
+static void declareVariable(Parser* parser){
+    Token* name = &parser->previous;
 
-    for (int i=current->localCount-1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+    for (int i=parser->compiler->localCount-1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
             break;
 
         if (identifiersEqual(name, &local->name))
-            error("Variable with this name already declared in scope.");
+            error(parser, "Variable with this name already declared in scope.");
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage){
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(Parser* parser, const char* errorMessage){
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    if (current->scopeDepth > 0) {
-        declareVariable();
+    if (parser->compiler->scopeDepth > 0) {
+        declareVariable(parser);
         return 0;
     }
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized(){
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser){
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global){
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(Parser* parser, uint8_t global){
+    if (parser->compiler->scopeDepth > 0) {
+        parser->compiler->locals[parser->compiler->localCount - 1].type = parser->compiler->exprType;
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
 /**************************************/
 
 /*********     Expressions    *********/
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static void number(bool canAssign){
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign){
+    double value;
+    parseNumber(parser->previous.start, parser->previous.length, &value);
+    emitConstant(parser, NUMBER_VAL(value));
+    parser->compiler->exprType = TYPE_NUMBER;
 }
 
-static void string(bool canAssign){
-    emitConstant(OBJ_VAL(copyString(
-                parser.previous.start + 1,
-                parser.previous.length -2))
+static void string(Parser* parser, bool canAssign){
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+                parser->previous.start + 1,
+                parser->previous.length -2))
             );
+    parser->compiler->exprType = TYPE_UNKNOWN;
 }
 
-static void namedVariable(Token name, bool canAssign){
+static void namedVariable(Parser* parser, Token name, bool canAssign){
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     }
     else {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
+        if (setOp == OP_SET_LOCAL) assignLocalType(parser, arg, parser->compiler->exprType);
+    }
+    else {
+        emitBytes(parser, getOp, (uint8_t)arg);
+        parser->compiler->exprType = getOp == OP_GET_LOCAL ? parser->compiler->locals[arg].type : TYPE_UNKNOWN;
     }
-    else
-        emitBytes(getOp, (uint8_t)arg);
 }
 
-static void variable(bool canAssign){
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign){
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void unary(bool canAssign){
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign){
+    TokenType operatorType = parser->previous.type;
 
     // Parse/compile the operand.
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     switch (operatorType) {
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            emitByte(parser, OP_NOT);
+            parser->compiler->exprType = TYPE_UNKNOWN;
             break;
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitByte(parser, parser->compiler->exprType == TYPE_NUMBER ? OP_NEGATE_UNCHECKED : OP_NEGATE);
+            parser->compiler->exprType = TYPE_NUMBER;
             break;
 
         default: return; // Unreachable.
     }
 }
 
-static void grouping(bool canAssign){
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
+static void grouping(Parser* parser, bool canAssign){
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
 }
 
-static void binary(bool canAssign){
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign){
+    TokenType operatorType = parser->previous.type;
+    int leftStart = parser->compiler->operandStart;
+    int rightStart = currentChunk(parser)->count;
+    ExprType leftType = parser->compiler->exprType;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence) (rule->precedence + 1));
+    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+
+    bool numbers = leftType == TYPE_NUMBER && parser->compiler->exprType == TYPE_NUMBER;
+    // -, * and / either produce a number or stop with a runtime error.
+    switch (operatorType) {
+        case TOKEN_PLUS:
+            parser->compiler->exprType = numbers ? TYPE_NUMBER : TYPE_UNKNOWN;
+            break;
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+            parser->compiler->exprType = TYPE_NUMBER;
+            break;
+        default:
+            parser->compiler->exprType = TYPE_UNKNOWN;
+            break;
+    }
+
+    if (emitRegisterOp(parser, operatorType, leftStart, rightStart)) return;
 
     switch (operatorType) {
-        case TOKEN_PLUS:  emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:  emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
-
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:  emitByte(parser, numbers ? OP_ADD_UNCHECKED : OP_ADD); break;
+        case TOKEN_MINUS: emitByte(parser, numbers ? OP_SUBTRACT_UNCHECKED : OP_SUBTRACT); break;
+        case TOKEN_STAR:  emitByte(parser, numbers ? OP_MULTIPLY_UNCHECKED : OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitByte(parser, numbers ? OP_DIVIDE_UNCHECKED : OP_DIVIDE); break;
+
+        case TOKEN_EQUAL_EQUAL: emitByte(parser, OP_EQUAL); break;
+        case TOKEN_BANG_EQUAL: emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_GREATER: emitByte(parser, numbers ? OP_GREATER_UNCHECKED : OP_GREATER); break;
+        case TOKEN_LESS: emitByte(parser, numbers ? OP_LESS_UNCHECKED : OP_LESS); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(parser, numbers ? OP_LESS_UNCHECKED : OP_LESS, OP_NOT); break;
+        case TOKEN_LESS_EQUAL: emitBytes(parser, numbers ? OP_GREATER_UNCHECKED : OP_GREATER, OP_NOT); break;
         default: return; // Unreachable
     }
 }
 
-static void and_(bool canAssign){
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-    patchJump(endJump);
+static void and_(Parser* parser, bool canAssign){
+    ExprType leftType = parser->compiler->exprType;
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+    patchJump(parser, endJump);
+    if (leftType != TYPE_NUMBER) parser->compiler->exprType = TYPE_UNKNOWN;
+}
+static void or_(Parser* parser, bool canAssign){
+    ExprType leftType = parser->compiler->exprType;
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
+
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
+    if (leftType != TYPE_NUMBER) parser->compiler->exprType = TYPE_UNKNOWN;
+}
+
+static uint8_t argumentList(Parser* parser){
+    uint8_t argCount = 0;
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(parser);
+            if (argCount == 255) error(parser, "Can't have more than 255 arguments.");
+            argCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after arguments.");
+    return argCount;
+}
+
+static void call(Parser* parser, bool canAssign){
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+    parser->compiler->lastCall = currentChunk(parser)->count;
+    parser->compiler->exprType = TYPE_UNKNOWN;
 }
-static void or_(bool canAssign){
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+static void list(Parser* parser, bool canAssign){
+    int count = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (check(parser, TOKEN_RIGHT_BRACKET)) break; // Trailing comma.
+            expression(parser);
+            if (count == 255) error(parser, "Can't have more than 255 items in a list literal.");
+            count++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expected ']' after list items.");
+    emitBytes(parser, OP_BUILD_LIST, (uint8_t) count);
+    parser->compiler->exprType = TYPE_UNKNOWN;
+}
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+static void map(Parser* parser, bool canAssign){
+    int count = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACE)) {
+        do {
+            if (check(parser, TOKEN_RIGHT_BRACE)) break; // Trailing comma.
+            expression(parser);
+            consume(parser, TOKEN_COLON, "Expected ':' after map key.");
+            expression(parser);
+            if (count == 255) error(parser, "Can't have more than 255 entries in a map literal.");
+            count++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after map entries.");
+    emitBytes(parser, OP_BUILD_MAP, (uint8_t) count);
+    parser->compiler->exprType = TYPE_UNKNOWN;
 }
 
-static void literal(bool canAssign){
-    switch (parser.previous.type) {
-        case TOKEN_NIL:     emitByte(OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(OP_TRUE); break;
-        case TOKEN_FALSE:   emitByte(OP_FALSE); break;
+static void index_(Parser* parser, bool canAssign){
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expected ']' after index.");
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_SET_INDEX);
+    }
+    else
+        emitByte(parser, OP_GET_INDEX);
+    parser->compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void dot(Parser* parser, bool canAssign){
+    consume(parser, TOKEN_IDENTIFIER, "Expected property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+    }
+    else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+    }
+    else
+        emitBytes(parser, OP_GET_PROPERTY, name);
+    emitCache(parser);
+    parser->compiler->exprType = TYPE_UNKNOWN;
+}
+
+// Functions don't capture variables, so a method's own body is the only place `this` is in scope.
+static bool inMethod(Parser* parser){
+    return parser->compiler->type == TYPE_METHOD || parser->compiler->type == TYPE_INITIALIZER;
+}
+
+static void this_(Parser* parser, bool canAssign){
+    if (!inMethod(parser)) {
+        error(parser, "Can't use 'this' outside of a method.");
+        return;
+    }
+    variable(parser, false);
+}
+
+static void super_(Parser* parser, bool canAssign){
+    if (!inMethod(parser))
+        error(parser, "Can't use 'super' outside of a method.");
+    else if (!parser->currentClass->hasSuperclass)
+        error(parser, "Can't use 'super' in a class with no superclass.");
+
+    consume(parser, TOKEN_DOT, "Expected '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expected superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    emitBytes(parser, OP_GET_LOCAL, 0);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
+    }
+    else
+        emitBytes(parser, OP_GET_SUPER, name);
+    parser->compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void literal(Parser* parser, bool canAssign){
+    switch (parser->previous.type) {
+        case TOKEN_NIL:     emitByte(parser, OP_NIL); break;
+        case TOKEN_TRUE:    emitByte(parser, OP_TRUE); break;
+        case TOKEN_FALSE:   emitByte(parser, OP_FALSE); break;
         default: return; // Unreachable
     }
+    parser->compiler->exprType = TYPE_UNKNOWN;
 }
 
 ParseRule rules[] = {
-        [TOKEN_LEFT_PAREN]      = {grouping,NULL,   PREC_NONE},
+        [TOKEN_LEFT_PAREN]      = {grouping,call,   PREC_CALL},
         [TOKEN_RIGHT_PAREN]     = {NULL,    NULL,   PREC_NONE},
-        [TOKEN_LEFT_BRACE]      = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_LEFT_BRACKET]    = {list,    index_, PREC_CALL},
+        [TOKEN_RIGHT_BRACKET]   = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_LEFT_BRACE]      = {map,     NULL,   PREC_NONE},
         [TOKEN_RIGHT_BRACE]     = {NULL,    NULL,   PREC_NONE},
         [TOKEN_COMMA]           = {NULL,    NULL,   PREC_NONE},
-        [TOKEN_DOT]             = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_DOT]             = {NULL,    dot,    PREC_CALL},
         [TOKEN_SEMICOLON]       = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_COLON]           = {NULL,    NULL,   PREC_NONE},
         [TOKEN_PLUS]            = {NULL,    binary, PREC_TERM},
         [TOKEN_MINUS]           = {unary,   binary, PREC_TERM},
         [TOKEN_STAR]            = {NULL,    binary, PREC_FACTOR},
@@ -457,9 +832,12 @@ ParseRule rules[] = {
         [TOKEN_WHILE]           = {NULL,    NULL,   PREC_NONE},
         [TOKEN_IF]              = {NULL,    NULL,   PREC_NONE},
         [TOKEN_ELSE]            = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_SWITCH]          = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_CASE]            = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_DEFAULT]         = {NULL,    NULL,   PREC_NONE},
         [TOKEN_CLASS]           = {NULL,    NULL,   PREC_NONE},
-        [TOKEN_SUPER]           = {NULL,    NULL,   PREC_NONE},
-        [TOKEN_THIS]            = {NULL,    NULL,   PREC_NONE},
+        [TOKEN_SUPER]           = {super_,  NULL,   PREC_NONE},
+        [TOKEN_THIS]            = {this_,   NULL,   PREC_NONE},
         [TOKEN_VAR]             = {NULL,    NULL,   PREC_NONE},
         [TOKEN_PRINT]           = {NULL,    NULL,   PREC_NONE},
         [TOKEN_ERROR]           = {NULL,    NULL,   PREC_NONE},
@@ -470,200 +848,444 @@ static ParseRule* getRule(TokenType type){
     return &rules[type];
 }
 
-static void parsePrecedence(Precedence prec){
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence prec){
+    int start = currentChunk(parser)->count;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expected expression.");
+        error(parser, "Expected expression.");
         return;
     }
 
     bool canAssign = prec <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (prec <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (prec <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        parser->compiler->operandStart = start;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL))
+        error(parser, "Invalid assignment target.");
 }
 
-static void expression(){
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser){
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block(){
-    while(!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-        declaration();
+static void block(Parser* parser){
+    while(!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+        declaration(parser);
 
-    consume(TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
 }
 
 /**************************************/
 
 /*********     Statements     *********/
 
-static void varDeclaration(){
-    uint8_t global = parseVariable("Expected variable name.");
-    if (match(TOKEN_EQUAL))
-        expression();
-    else
-        emitByte(OP_NIL);
-    consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+static void function(Parser* parser, FunctionType type){
+    Compiler compiler;
+    initCompiler(parser, &compiler, type, NULL);
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            uint8_t constant = parseVariable(parser, "Expected parameter name.");
+            parser->compiler->exprType = TYPE_UNKNOWN;
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+    block(parser);
 
-    defineVariable(global);
+    ObjFunction* compiled = endCompiler(parser);
+    emitConstant(parser, OBJ_VAL(compiled));
+    parser->compiler->exprType = TYPE_UNKNOWN;
 }
 
-static void printStatement(){
-    expression();
-    consume(TOKEN_SEMICOLON, "Expected ';' after value.");
-    emitByte(OP_PRINT);
+static void funDeclaration(Parser* parser){
+    uint8_t global = parseVariable(parser, "Expected function name.");
+    // Initialized straight away so the body can call itself.
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement(){
-    expression();
-    consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
-    emitByte(OP_POP);
+static void method(Parser* parser){
+    consume(parser, TOKEN_IDENTIFIER, "Expected method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
+    FunctionType type = TYPE_METHOD;
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0)
+        type = TYPE_INITIALIZER;
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void ifStatement(){
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
+static void classDeclaration(Parser* parser){
+    consume(parser, TOKEN_IDENTIFIER, "Expected class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    if (parser->compiler->scopeDepth > 0) declareVariable(parser);
+
+    emitBytes(parser, OP_CLASS, nameConstant);
+    parser->compiler->exprType = TYPE_UNKNOWN;
+    defineVariable(parser, nameConstant);
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    classCompiler.hasSuperclass = false;
+    parser->currentClass = &classCompiler;
+
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expected superclass name.");
+        if (identifiersEqual(&className, &parser->previous))
+            error(parser, "A class can't inherit from itself.");
+        variable(parser, false);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
+        classCompiler.hasSuperclass = true;
+    }
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+        method(parser);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+    emitByte(parser, OP_POP);
 
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    parser->currentClass = classCompiler.enclosing;
+}
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+static void varDeclaration(Parser* parser){
+    uint8_t global = parseVariable(parser, "Expected variable name.");
+    if (match(parser, TOKEN_EQUAL))
+        expression(parser);
+    else {
+        emitByte(parser, OP_NIL);
+        parser->compiler->exprType = TYPE_UNKNOWN;
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+
+    defineVariable(parser, global);
 }
 
-static void whileStatement(){
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
+static void printStatement(Parser* parser){
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after value.");
+    emitByte(parser, OP_PRINT);
+}
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+static void expressionStatement(Parser* parser){
+    int start = currentChunk(parser)->count;
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after expression.");
+    discardExpression(parser, start);
+}
+
+static void ifStatement(Parser* parser){
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
+
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
+
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
+}
+
+// A case value: a number literal, negated or not, or a string literal.
+static bool caseValue(Parser* parser, Value* value){
+    bool negate = match(parser, TOKEN_MINUS);
+    if (match(parser, TOKEN_NUMBER)) {
+        double number;
+        parseNumber(parser->previous.start, parser->previous.length, &number);
+        *value = NUMBER_VAL(negate ? -number : number);
+        return true;
+    }
+    if (!negate && match(parser, TOKEN_STRING)) {
+        *value = OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2));
+        return true;
+    }
+    errorAtCurrent(parser, "Case value must be a number or string literal.");
+    return false;
+}
+
+static bool isSmallWhole(double number){
+    return number > -SWITCH_NUMBER_MAX && number < SWITCH_NUMBER_MAX && number == (int) number;
+}
+
+/* Whole-number cases spanning a range no more than twice their count get an
+ * array indexed by value; the rest keep the table of cases to offsets. */
+static void finishSwitch(SwitchTable* table, Table* cases, int defaultOffset, bool whole, double low, double high){
+    table->defaultOffset = defaultOffset;
+    int count = cases->count;
+    int limit = count * 2 > SWITCH_DENSE_MIN ? count * 2 : SWITCH_DENSE_MIN;
+    if (count == 0 || !whole || high - low >= limit) {
+        table->cases = *cases;
+        return;
+    }
+
+    table->dense = true;
+    table->low = (int) low;
+    table->count = (int) (high - low) + 1;
+    table->offsets = ALLOCATE(int, table->count);
+    for (int i = 0; i < table->count; i++) table->offsets[i] = defaultOffset;
+    for (int i = 0; i < cases->capacity; i++) {
+        Entry* entry = &cases->entries[i];
+        if (IS_NIL(entry->key)) continue;
+        table->offsets[(int) AS_NUMBER(entry->key) - table->low] = (int) AS_NUMBER(entry->value);
+    }
+    freeTable(cases);
+}
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+/* Each case runs its statements in a scope of its own and leaves the
+ * switch; there is no falling through. OP_SWITCH goes straight to the
+ * case, through a table filled in once every case has its offset. */
+static void switchStatement(Parser* parser){
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'switch'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after value.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before switch cases.");
+
+    Chunk* chunk = currentChunk(parser);
+    int index = addSwitch(chunk);
+    if (index > UINT16_MAX) error(parser, "Too many switch statements in one function.");
+    emitByte(parser, OP_SWITCH);
+    emitBytes(parser, (index >> 8) & 0xff, index & 0xff);
+    int start = chunk->count;
+
+    Table cases;
+    initTable(&cases);
+    int defaultOffset = -1;
+    bool whole = true;
+    double low = 0;
+    double high = 0;
+    int* exits = NULL;
+    int exitCount = 0;
+    int exitCapacity = 0;
+
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        int offset = chunk->count - start;
+        if (match(parser, TOKEN_DEFAULT)) {
+            if (defaultOffset != -1) error(parser, "Can't have more than one default case.");
+            defaultOffset = offset;
+        }
+        else {
+            consume(parser, TOKEN_CASE, "Expected 'case' or 'default'.");
+            do {
+                Value value;
+                if (!caseValue(parser, &value)) break;
+                Value seen;
+                if (tableGetValue(&cases, value, &seen)) error(parser, "Duplicate case value.");
+                tableSetValue(&cases, value, NUMBER_VAL(offset));
+
+                if (!IS_NUMBER(value) || !isSmallWhole(AS_NUMBER(value))) whole = false;
+                else if (cases.count == 1) low = high = AS_NUMBER(value);
+                else {
+                    if (AS_NUMBER(value) < low) low = AS_NUMBER(value);
+                    if (AS_NUMBER(value) > high) high = AS_NUMBER(value);
+                }
+            } while (match(parser, TOKEN_COMMA));
+        }
+        consume(parser, TOKEN_COLON, "Expected ':' after case.");
+        parser->compiler->lastLabel = chunk->count;
+
+        beginScope(parser);
+        while (!check(parser, TOKEN_CASE) && !check(parser, TOKEN_DEFAULT)
+               && !check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+            declaration(parser);
+        endScope(parser);
+
+        if (exitCapacity < exitCount + 1) {
+            int oldCapacity = exitCapacity;
+            exitCapacity = GROW_CAPACITY(oldCapacity);
+            exits = GROW_ARRAY(int, exits, oldCapacity, exitCapacity);
+        }
+        exits[exitCount++] = emitJump(parser, OP_JUMP);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after switch cases.");
+
+    // The last case ends where the switch does.
+    if (exitCount > 0) {
+        chunk->count -= 3;
+        exitCount--;
+    }
+    for (int i = 0; i < exitCount; i++) patchJump(parser, exits[i]);
+    parser->compiler->lastLabel = chunk->count;
+    FREE_ARRAY(int, exits, exitCapacity);
+
+    if (defaultOffset == -1) defaultOffset = chunk->count - start;
+    finishSwitch(&chunk->switches[index], &cases, defaultOffset, whole, low, high);
+}
+
+static void whileStatement(Parser* parser){
+    int loopStart = currentChunk(parser)->count;
+    beginLoop(parser, loopStart);
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
+    endLoop(parser);
 }
 
-static void forStatement(){
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
-    // Check if you could replace all entire bit with just: declaration();
-    if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser* parser){
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
+    // Check if you could replace all entire bit with just: declaration(parser);
+    if (match(parser, TOKEN_SEMICOLON)) {
         // Do nothing.
     }
-    else if (match(TOKEN_VAR))
-        varDeclaration();
+    else if (match(parser, TOKEN_VAR))
+        varDeclaration(parser);
     else
-        expressionStatement();
+        expressionStatement(parser);
     // unitl here!
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
+    beginLoop(parser, loopStart);
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expected ';' after condition.");
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); //condition val
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expected ';' after condition.");
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP); //condition val
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'for' clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        discardExpression(parser, incrementStart);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after 'for' clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP); //condition val
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP); //condition val
     }
-    endScope();
+    endLoop(parser);
+    endScope(parser);
 }
 
-static void statement() {
-    if (match(TOKEN_PRINT))
-        printStatement();
+/* A call right before the return is a tail call: the callee takes over the
+ * returning function's frame instead of stacking a new one on top. */
+static void returnStatement(Parser* parser){
+    if (parser->compiler->type == TYPE_SCRIPT)
+        error(parser, "Can't return from top-level code.");
 
-    else if (match(TOKEN_IF))
-        ifStatement();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
+        return;
+    }
+
+    if (parser->compiler->type == TYPE_INITIALIZER)
+        error(parser, "Can't return a value from an initializer.");
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after return value.");
+    Chunk* chunk = currentChunk(parser);
+    if (parser->compiler->lastCall == chunk->count && chunk->code[chunk->count - 2] == OP_CALL)
+        chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+    emitByte(parser, OP_RETURN);
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT))
+        printStatement(parser);
 
-    else if (match(TOKEN_WHILE))
-        whileStatement();
+    else if (match(parser, TOKEN_RETURN))
+        returnStatement(parser);
 
-    else if (match(TOKEN_FOR))
-        forStatement();
+    else if (match(parser, TOKEN_IF))
+        ifStatement(parser);
 
-    else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+    else if (match(parser, TOKEN_SWITCH))
+        switchStatement(parser);
+
+    else if (match(parser, TOKEN_WHILE))
+        whileStatement(parser);
+
+    else if (match(parser, TOKEN_FOR))
+        forStatement(parser);
+
+    else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
 
     else
-        expressionStatement();
+        expressionStatement(parser);
 }
 
-static void declaration(){
-    if (match(TOKEN_VAR))
-        varDeclaration();
+static void declaration(Parser* parser){
+    if (match(parser, TOKEN_CLASS))
+        classDeclaration(parser);
+    else if (match(parser, TOKEN_FUN))
+        funDeclaration(parser);
+    else if (match(parser, TOKEN_VAR))
+        varDeclaration(parser);
     else
-        statement();
+        statement(parser);
 
-    if (parser.panicMode) synchronize();
+    if (parser->panicMode) synchronize(parser);
 }
 
 /**************************************/
 
 /*********     Compiling      *********/
 
-static void endCompiler(){
-    emitReturn();
-#ifdef DEBUG_PRINT_CODE
-    if(!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
-    }
-#endif
+bool compile(VM* vm, const char* source, Chunk* chunk){
+    return compileFrom(vm, source, 1, chunk);
 }
 
-bool compile(const char* source, Chunk* chunk){
-    initScanner(source);
+bool compileFrom(VM* vm, const char* source, int line, Chunk* chunk){
+    TIMELINE_BEGIN("compile");
+    Parser parser;
+    parser.vm = vm;
+    initScanner(&parser.scanner, source);
+    parser.scanner.line = line;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
     Compiler compiler;
-    initCompiler(&compiler);
-    compilingChunk = chunk;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT, chunk);
 
     parser.hadError = false;
     parser.panicMode = false;
 
-    advance();
+    advance(&parser);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    endCompiler();
+    endCompiler(&parser);
+    TIMELINE_END("compile");
     return !parser.hadError;
 }
\ No newline at end of file
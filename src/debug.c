@@ -3,102 +3,260 @@
 #include "debug.h"
 #include "value.h"
 
-void disassembleChunk(Chunk* chunk, const char* name){
-    printf("=== %s ===\n", name);
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name){
+    fprintf(out, "=== %s ===\n", name);
 
     for (int offset=0; offset < chunk->count;){
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(out, chunk, offset);
     }
 }
 
-static int simpleInstruction(const char* name, int offset){
-    printf("\t%s\n", name);
+static int simpleInstruction(FILE* out, const char* name, int offset){
+    fprintf(out, "\t%s\n", name);
     return offset + 1;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset){
+// Listed as the instruction the compiler emitted, then what run() made of it.
+static int quickenedInstruction(FILE* out, const char* generic, const char* name, int offset){
+    fprintf(out, "\t%-16s (as %s)\n", generic, name);
+    return offset + 1;
+}
+
+static int constantInstruction(FILE* out, const char* name, Chunk* chunk, int offset){
     uint8_t constant = chunk->code[offset + 1];
-    printf("\t%-16s %-4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "\t%-16s %-4d '", name, constant);
+    fprintValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
     return offset + 2;
 }
-static int byteInstruction(const char* name, Chunk* chunk, int offset){
+static int byteInstruction(FILE* out, const char* name, Chunk* chunk, int offset){
     uint8_t slot = chunk->code[offset + 1];
-    printf("\t%-16s %-4d", name, slot);
-    printf("\n");
+    fprintf(out, "\t%-16s %-4d", name, slot);
+    fprintf(out, "\n");
     return offset + 2;
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset){
+// A constant name, an argument count for invokes, and an inline cache index.
+static int propertyInstruction(FILE* out, const char* name, Chunk* chunk, int offset, bool invoke){
+    uint8_t constant = chunk->code[offset + 1];
+    fprintf(out, "\t%-16s %-4d '", name, constant);
+    fprintValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'");
+    if (invoke) {
+        fprintf(out, " (%d args)", chunk->code[offset + 2]);
+        offset++;
+    }
+    fprintf(out, " cache %d\n", (chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    return offset + 4;
+}
+
+static int superInvokeInstruction(FILE* out, Chunk* chunk, int offset){
+    uint8_t constant = chunk->code[offset + 1];
+    fprintf(out, "\t%-16s %-4d '", "OP_SUPER_INVOKE", constant);
+    fprintValue(out, chunk->constants.values[constant]);
+    fprintf(out, "' (%d args)\n", chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int jumpInstruction(FILE* out, const char* name, int sign, Chunk* chunk, int offset){
     uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("\t%-16s %-4d -> %d", name, offset, offset + 3 + sign * jump);
-    printf("\n");
+    fprintf(out, "\t%-16s %-4d -> %d", name, offset, offset + 3 + sign * jump);
+    fprintf(out, "\n");
+    return offset + 3;
+}
+
+static int switchInstruction(FILE* out, Chunk* chunk, int offset){
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    SwitchTable* table = &chunk->switches[index];
+    int end = offset + 3;
+    fprintf(out, "\t%-16s %-4d", "OP_SWITCH", index);
+    if (table->dense) {
+        for (int i = 0; i < table->count; i++)
+            if (table->offsets[i] != table->defaultOffset)
+                fprintf(out, " %d -> %d", table->low + i, end + table->offsets[i]);
+    }
+    else {
+        for (int i = 0; i < table->cases.capacity; i++) {
+            Entry* entry = &table->cases.entries[i];
+            if (IS_NIL(entry->key)) continue;
+            fprintf(out, " ");
+            fprintValue(out, entry->key);
+            fprintf(out, " -> %d", end + (int) AS_NUMBER(entry->value));
+        }
+    }
+    fprintf(out, " default -> %d\n", end + table->defaultOffset);
+    return end;
+}
+
+static void registerOperand(FILE* out, Chunk* chunk, uint8_t operand){
+    if (operand & REGISTER_CONSTANT) {
+        fprintf(out, " k%d '", operand & REGISTER_MAX);
+        fprintValue(out, chunk->constants.values[operand & REGISTER_MAX]);
+        fprintf(out, "'");
+    }
+    else {
+        fprintf(out, " r%d", operand);
+    }
+}
+
+static int registerInstruction(FILE* out, const char* name, Chunk* chunk, int offset){
+    fprintf(out, "\t%-16s", name);
+    registerOperand(out, chunk, chunk->code[offset + 1]);
+    registerOperand(out, chunk, chunk->code[offset + 2]);
+    fprintf(out, "\n");
     return offset + 3;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset){
+static int registerSetInstruction(FILE* out, const char* name, Chunk* chunk, int offset){
+    fprintf(out, "\t%-16s r%d <-", name, chunk->code[offset + 1]);
+    registerOperand(out, chunk, chunk->code[offset + 2]);
+    registerOperand(out, chunk, chunk->code[offset + 3]);
+    fprintf(out, "\n");
+    return offset + 4;
+}
+
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset){
 //    printf("chunk constants count: %d\n", chunk->constants.count);
-    printf("%04d ", offset);
+    fprintf(out, "%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]){
-        printf("\t|");
+        fprintf(out, "\t|");
     }
     else{
-        printf("\t%d", chunk->lines[offset]);
+        fprintf(out, "\t%d", chunk->lines[offset]);
     }
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_ADD:
-            return simpleInstruction("OP_ADD", offset);
+            return simpleInstruction(out, "OP_ADD", offset);
         case OP_SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
+            return simpleInstruction(out, "OP_SUBTRACT", offset);
         case OP_MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
+            return simpleInstruction(out, "OP_MULTIPLY", offset);
         case OP_DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
+            return simpleInstruction(out, "OP_DIVIDE", offset);
         case OP_NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
+            return simpleInstruction(out, "OP_NEGATE", offset);
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction(out, "OP_CONSTANT", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return constantInstruction(out, "OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return constantInstruction(out, "OP_SET_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return constantInstruction(out, "OP_GET_GLOBAL", chunk, offset);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction(out, "OP_SET_LOCAL", chunk, offset);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction(out, "OP_GET_LOCAL", chunk, offset);
         case OP_NIL:
-            return simpleInstruction("OP_NIL", offset);
+            return simpleInstruction(out, "OP_NIL", offset);
         case OP_TRUE:
-            return simpleInstruction("OP_TRUE", offset);
+            return simpleInstruction(out, "OP_TRUE", offset);
         case OP_FALSE:
-            return simpleInstruction("OP_FALSE", offset);
+            return simpleInstruction(out, "OP_FALSE", offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction(out, "OP_LOOP", -1, chunk, offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction(out, "OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction(out, "OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_SWITCH:
+            return switchInstruction(out, chunk, offset);
         case OP_NOT:
-            return simpleInstruction("OP_NOT", offset);
+            return simpleInstruction(out, "OP_NOT", offset);
         case OP_EQUAL:
-            return simpleInstruction("OP_EQUAL", offset);
+            return simpleInstruction(out, "OP_EQUAL", offset);
         case OP_GREATER:
-            return simpleInstruction("OP_GREATER", offset);
+            return simpleInstruction(out, "OP_GREATER", offset);
         case OP_LESS:
-            return simpleInstruction("OP_LESS", offset);
+            return simpleInstruction(out, "OP_LESS", offset);
         case OP_PRINT:
-            return simpleInstruction("OP_PRINT", offset);
+            return simpleInstruction(out, "OP_PRINT", offset);
         case OP_POP:
-            return simpleInstruction("OP_POP", offset);
+            return simpleInstruction(out, "OP_POP", offset);
+        case OP_CALL:
+            return byteInstruction(out, "OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction(out, "OP_TAIL_CALL", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction(out, "OP_BUILD_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction(out, "OP_BUILD_MAP", chunk, offset);
+        case OP_CLASS:
+            return constantInstruction(out, "OP_CLASS", chunk, offset);
+        case OP_INHERIT:
+            return simpleInstruction(out, "OP_INHERIT", offset);
+        case OP_METHOD:
+            return constantInstruction(out, "OP_METHOD", chunk, offset);
+        case OP_GET_PROPERTY:
+            return propertyInstruction(out, "OP_GET_PROPERTY", chunk, offset, false);
+        case OP_SET_PROPERTY:
+            return propertyInstruction(out, "OP_SET_PROPERTY", chunk, offset, false);
+        case OP_INVOKE:
+            return propertyInstruction(out, "OP_INVOKE", chunk, offset, true);
+        case OP_GET_SUPER:
+            return constantInstruction(out, "OP_GET_SUPER", chunk, offset);
+        case OP_SUPER_INVOKE:
+            return superInvokeInstruction(out, chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction(out, "OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction(out, "OP_SET_INDEX", offset);
         case OP_RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction(out, "OP_RETURN", offset);
+        case OP_ADD_RK:
+            return registerInstruction(out, "OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerInstruction(out, "OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerInstruction(out, "OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerInstruction(out, "OP_DIVIDE_RK", chunk, offset);
+        case OP_EQUAL_RK:
+            return registerInstruction(out, "OP_EQUAL_RK", chunk, offset);
+        case OP_GREATER_RK:
+            return registerInstruction(out, "OP_GREATER_RK", chunk, offset);
+        case OP_LESS_RK:
+            return registerInstruction(out, "OP_LESS_RK", chunk, offset);
+        case OP_ADD_RK_SET:
+            return registerSetInstruction(out, "OP_ADD_RK_SET", chunk, offset);
+        case OP_SUBTRACT_RK_SET:
+            return registerSetInstruction(out, "OP_SUBTRACT_RK_SET", chunk, offset);
+        case OP_MULTIPLY_RK_SET:
+            return registerSetInstruction(out, "OP_MULTIPLY_RK_SET", chunk, offset);
+        case OP_DIVIDE_RK_SET:
+            return registerSetInstruction(out, "OP_DIVIDE_RK_SET", chunk, offset);
+        case OP_ADD_NUM:
+            return quickenedInstruction(out, "OP_ADD", "OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return quickenedInstruction(out, "OP_ADD", "OP_ADD_STR", offset);
+        case OP_SUBTRACT_NUM:
+            return quickenedInstruction(out, "OP_SUBTRACT", "OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return quickenedInstruction(out, "OP_MULTIPLY", "OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return quickenedInstruction(out, "OP_DIVIDE", "OP_DIVIDE_NUM", offset);
+        case OP_GREATER_NUM:
+            return quickenedInstruction(out, "OP_GREATER", "OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return quickenedInstruction(out, "OP_LESS", "OP_LESS_NUM", offset);
+        case OP_ADD_UNCHECKED:
+            return simpleInstruction(out, "OP_ADD_UNCHECKED", offset);
+        case OP_SUBTRACT_UNCHECKED:
+            return simpleInstruction(out, "OP_SUBTRACT_UNCHECKED", offset);
+        case OP_MULTIPLY_UNCHECKED:
+            return simpleInstruction(out, "OP_MULTIPLY_UNCHECKED", offset);
+        case OP_DIVIDE_UNCHECKED:
+            return simpleInstruction(out, "OP_DIVIDE_UNCHECKED", offset);
+        case OP_GREATER_UNCHECKED:
+            return simpleInstruction(out, "OP_GREATER_UNCHECKED", offset);
+        case OP_LESS_UNCHECKED:
+            return simpleInstruction(out, "OP_LESS_UNCHECKED", offset);
+        case OP_NEGATE_UNCHECKED:
+            return simpleInstruction(out, "OP_NEGATE_UNCHECKED", offset);
         default:
-            printf("\tUnknown opcode %d\n", instruction);
+            fprintf(out, "\tUnknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
@@ -0,0 +1,282 @@
+#include "fiber.h"
+#include "io.h"
+#include "memory.h"
+
+// Frames a fiber starts with; most never call deeper than this.
+#define FIBER_FRAMES 4
+
+/*********     Switching      *********/
+
+static void saveFiber(VM* vm){
+    ObjFiber* fiber = vm->fiber;
+    fiber->frames[vm->frameCount - 1].ip = vm->ip;
+    fiber->frameCount = vm->frameCount;
+    fiber->stackTop = vm->stackTop;
+}
+
+static void loadFiber(VM* vm, ObjFiber* fiber){
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->stackTop = fiber->stackTop;
+    if (fiber->frameCount == 0) {
+        vm->slots = fiber->stack;
+        return;
+    }
+    CallFrame* frame = &fiber->frames[fiber->frameCount - 1];
+    vm->chunk = frame->chunk;
+    vm->ip = frame->ip;
+    vm->slots = frame->slots;
+}
+
+// Sets up the call to the fiber's function, passing `value` if it takes it.
+static void startFiber(ObjFiber* fiber, Value value){
+    ObjFunction* function = fiber->function;
+    fiber->stackCapacity = function->chunk.maxStack;
+    fiber->stack = ALLOCATE(Value, fiber->stackCapacity);
+    fiber->frameCapacity = FIBER_FRAMES;
+    fiber->frames = ALLOCATE(CallFrame, fiber->frameCapacity);
+
+    fiber->stack[0] = OBJ_VAL(function);
+    if (function->arity == 1) fiber->stack[1] = value;
+    fiber->stackTop = fiber->stack + 1 + function->arity;
+
+    CallFrame* frame = &fiber->frames[0];
+    frame->function = function;
+    frame->chunk = &function->chunk;
+    frame->ip = function->chunk.code;
+    frame->slots = fiber->stack;
+    fiber->frameCount = 1;
+}
+
+// Continues `fiber`, which gets `value` as the result of its resume() or yield().
+static void enterFiber(VM* vm, ObjFiber* fiber, Value value){
+    if (fiber->frameCount == 0) startFiber(fiber, value);
+    else fiber->stackTop[-1] = value;
+    fiber->state = FIBER_RUNNING;
+    loadFiber(vm, fiber);
+}
+
+// Queued fibers have been started and have their result in place.
+static void enterQueued(VM* vm, ObjFiber* fiber){
+    fiber->state = FIBER_RUNNING;
+    loadFiber(vm, fiber);
+}
+
+// A finished fiber keeps nothing but its header.
+static void releaseFiber(ObjFiber* fiber){
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+    fiber->stack = NULL;
+    fiber->stackCapacity = 0;
+    fiber->stackTop = NULL;
+    fiber->frames = NULL;
+    fiber->frameCapacity = 0;
+    fiber->frameCount = 0;
+}
+
+/**************************************/
+
+/*********     Run queue      *********/
+
+static void enqueue(VM* vm, ObjFiber* fiber){
+    fiber->state = FIBER_READY;
+    fiber->next = NULL;
+    if (vm->readyTail == NULL) vm->readyHead = fiber;
+    else vm->readyTail->next = fiber;
+    vm->readyTail = fiber;
+}
+
+static ObjFiber* dequeue(VM* vm){
+    ObjFiber* fiber = vm->readyHead;
+    if (fiber == NULL) return NULL;
+    vm->readyHead = fiber->next;
+    if (vm->readyHead == NULL) vm->readyTail = NULL;
+    fiber->next = NULL;
+    return fiber;
+}
+
+// The next fiber to run, waiting for I/O if that's all there is; NULL when there's none.
+static ObjFiber* nextFiber(VM* vm){
+    IoLoop* io = &vm->io;
+    if (io->waiting > 0 && ++io->sincePoll >= IO_POLL_INTERVAL) pollIo(vm, false);
+    while (vm->readyHead == NULL && io->waiting > 0) pollIo(vm, true);
+    return dequeue(vm);
+}
+
+/**************************************/
+
+void initFibers(VM* vm){
+    ObjFiber* main = &vm->mainFiber;
+    main->Obj.type = OBJ_FIBER;
+    main->Obj.next = NULL;
+    main->state = FIBER_RUNNING;
+    main->function = NULL;
+    main->stack = NULL;
+    main->stackCapacity = 0;
+    main->stackTop = NULL;
+    main->frames = NULL;
+    main->frameCapacity = 0;
+    main->frameCount = 0;
+    main->caller = NULL;
+    main->next = NULL;
+    vm->readyHead = NULL;
+    vm->readyTail = NULL;
+    vm->holdFibers = false;
+    loadFiber(vm, main);
+}
+
+void freeFibers(VM* vm){
+    releaseFiber(&vm->mainFiber);
+}
+
+void resetFibers(VM* vm){
+    ObjFiber* main = &vm->mainFiber;
+    ObjFiber* fiber = vm->fiber;
+    while (fiber != NULL) {
+        ObjFiber* caller = fiber->caller;
+        fiber->caller = NULL;
+        fiber->state = FIBER_DONE;
+        if (fiber != main) releaseFiber(fiber);
+        fiber = caller;
+    }
+    cancelIo(vm);
+    while ((fiber = dequeue(vm)) != NULL) {
+        fiber->state = FIBER_DONE;
+        if (fiber != main) releaseFiber(fiber);
+    }
+
+    main->state = FIBER_RUNNING;
+    main->frameCount = 0;
+    main->stackTop = main->stack;
+    loadFiber(vm, main);
+}
+
+bool growFrames(VM* vm){
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->frameCapacity == FRAMES_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    int capacity = fiber->frameCapacity < FIBER_FRAMES ? FIBER_FRAMES : fiber->frameCapacity * 2;
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+    fiber->frames = GROW_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity, capacity);
+    fiber->frameCapacity = capacity;
+    vm->frames = fiber->frames;
+    return true;
+}
+
+bool growStack(VM* vm, int needed){
+    if (needed > STACK_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    ObjFiber* fiber = vm->fiber;
+    int capacity = fiber->stackCapacity * 2;
+    if (capacity < needed) capacity = needed;
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+    Value* old = fiber->stack;
+    fiber->stack = GROW_ARRAY(Value, fiber->stack, fiber->stackCapacity, capacity);
+    fiber->stackCapacity = capacity;
+    if (fiber->stack == old) return true;
+
+    // Everything pointing into the old stack moves along with it.
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].slots = fiber->stack + (vm->frames[i].slots - old);
+    vm->slots = fiber->stack + (vm->slots - old);
+    vm->stackTop = fiber->stack + (vm->stackTop - old);
+    return true;
+}
+
+/*********     Scheduling     *********/
+
+bool resumeFiber(VM* vm, ObjFiber* fiber, Value value, Value* result){
+    if (fiber->state == FIBER_DONE) {
+        runtimeError(vm, "Can't resume a finished fiber.");
+        return false;
+    }
+    if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+        runtimeError(vm, "Can't resume a fiber that is running or queued.");
+        return false;
+    }
+    vm->stackTop = result + 1;
+    saveFiber(vm);
+    vm->fiber->state = FIBER_WAITING;
+    fiber->caller = vm->fiber;
+    enterFiber(vm, fiber, value);
+    return true;
+}
+
+void yieldFiber(VM* vm, Value value, Value* result){
+    ObjFiber* fiber = vm->fiber;
+    vm->stackTop = result + 1;
+    saveFiber(vm);
+    if (fiber->caller != NULL) {
+        ObjFiber* caller = fiber->caller;
+        fiber->caller = NULL;
+        fiber->state = FIBER_SUSPENDED;
+        enterFiber(vm, caller, value);
+        return;
+    }
+    // Nobody to hand the value to: let the queue have a turn.
+    *result = NIL_VAL;
+    enqueue(vm, fiber);
+    enterQueued(vm, nextFiber(vm));
+}
+
+void blockFiber(VM* vm, Value* result){
+    vm->stackTop = result + 1;
+    saveFiber(vm);
+    vm->fiber->state = FIBER_BLOCKED;
+    // Whatever it's waiting for is what keeps nextFiber() from coming back empty.
+    enterQueued(vm, nextFiber(vm));
+}
+
+void wakeFiber(VM* vm, ObjFiber* fiber, Value value){
+    fiber->stackTop[-1] = value;
+    enqueue(vm, fiber);
+}
+
+void spawnFiber(VM* vm, ObjFiber* fiber, Value value){
+    startFiber(fiber, value);
+    enqueue(vm, fiber);
+}
+
+bool finishFiber(VM* vm){
+    ObjFiber* fiber = vm->fiber;
+    ObjFiber* main = &vm->mainFiber;
+    Value result = fiber == main ? NIL_VAL : vm->stackTop[-1];
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    fiber->state = FIBER_DONE;
+    if (fiber == main) {
+        main->frameCount = 0;
+        main->stackTop = main->stack;
+    }
+    else releaseFiber(fiber);
+
+    if (caller != NULL) {
+        enterFiber(vm, caller, result);
+        return true;
+    }
+    // A held queue waits for runQueued() once the script is done.
+    ObjFiber* next = fiber == main && vm->holdFibers ? NULL : nextFiber(vm);
+    if (next != NULL) {
+        enterQueued(vm, next);
+        return true;
+    }
+    main->state = FIBER_RUNNING;
+    loadFiber(vm, main);
+    return false;
+}
+
+bool enterQueuedFiber(VM* vm){
+    ObjFiber* next = nextFiber(vm);
+    if (next == NULL) return false;
+    vm->mainFiber.state = FIBER_DONE;
+    enterQueued(vm, next);
+    return true;
+}
+
+/**************************************/
@@ -0,0 +1,521 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "timeline.h"
+
+#define IMAGE_MAGIC "CLOXIMG"
+#define IMAGE_VERSION 7
+#define IMAGE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t valueSize;
+    uint32_t stringSize;
+    uint32_t entrySize;
+    uint64_t base;
+    uint64_t size;
+    uint64_t globals;
+    int32_t globalsCount;
+    int32_t globalsCapacity;
+    uint64_t strings;
+    int32_t stringsCount;
+    int32_t stringsCapacity;
+    uint64_t relocations;
+    uint64_t relocationCount;
+} ImageHeader;
+
+typedef struct {
+    Obj* object;
+    size_t offset;
+} ImageObject;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    uint64_t* relocations;
+    size_t relocationCount;
+    size_t relocationCapacity;
+    ImageObject* objects;
+    int objectCount;
+} ImageWriter;
+
+/*********       Saving       *********/
+
+// Returns the offset of `size` zeroed bytes at the end of the image.
+static size_t reserve(ImageWriter* writer, size_t size){
+    size_t offset = writer->count;
+    size_t end = offset + IMAGE_ALIGN(size);
+    if (writer->capacity < end) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->capacity < end) writer->capacity = GROW_CAPACITY(writer->capacity);
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    memset(writer->bytes + offset, 0, end - offset);
+    writer->count = end;
+    return offset;
+}
+
+// Stores the address `target` will have at IMAGE_BASE and remembers to relocate it.
+static void writePointer(ImageWriter* writer, size_t at, size_t target){
+    uintptr_t address = IMAGE_BASE + target;
+    memcpy(writer->bytes + at, &address, sizeof(address));
+
+    if (writer->relocationCapacity < writer->relocationCount + 1) {
+        size_t oldCapacity = writer->relocationCapacity;
+        writer->relocationCapacity = GROW_CAPACITY(oldCapacity);
+        writer->relocations = GROW_ARRAY(uint64_t, writer->relocations,
+                                         oldCapacity, writer->relocationCapacity);
+    }
+    writer->relocations[writer->relocationCount++] = at;
+}
+
+static int compareObjects(const void* a, const void* b){
+    uintptr_t left = (uintptr_t) ((const ImageObject*) a)->object;
+    uintptr_t right = (uintptr_t) ((const ImageObject*) b)->object;
+    return (left > right) - (left < right);
+}
+
+static size_t objectOffset(ImageWriter* writer, Obj* object){
+    ImageObject key = {object, 0};
+    ImageObject* found = bsearch(&key, writer->objects, writer->objectCount,
+                                 sizeof(ImageObject), compareObjects);
+    return found->offset;
+}
+
+static void writeValue(ImageWriter* writer, size_t at, Value value);
+static void writeEntries(ImageWriter* writer, size_t offset, Table* table);
+
+// Natives and fibers aren't written, see saveImage().
+static bool leftOutObject(Obj* object){
+    return object->type == OBJ_NATIVE || object->type == OBJ_FIBER;
+}
+
+static bool leftOut(Value value){
+    return IS_OBJ(value) && leftOutObject(AS_OBJ(value));
+}
+
+/* Copies an object into the image. References to other objects can only be
+ * written once every object has an offset, by linkObject(). */
+static size_t layoutObject(ImageWriter* writer, Obj* object){
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            size_t offset = reserve(writer, sizeof(ObjBoundMethod));
+            memcpy(writer->bytes + offset, object, sizeof(ObjBoundMethod));
+            ((ObjBoundMethod*) (writer->bytes + offset))->Obj.next = NULL;
+            return offset;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) object;
+            size_t offset = reserve(writer, sizeof(ObjClass));
+            size_t methods = reserve(writer, sizeof(Entry) * klass->methods.capacity);
+            memcpy(writer->bytes + offset, klass, sizeof(ObjClass));
+            ((ObjClass*) (writer->bytes + offset))->Obj.next = NULL;
+            if (klass->methods.entries != NULL)
+                writePointer(writer, offset + offsetof(ObjClass, methods.entries), methods);
+            return offset;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            Chunk* chunk = &function->chunk;
+            size_t offset = reserve(writer, sizeof(ObjFunction));
+            // Right behind the function, where linkObject() expects them.
+            size_t constants = reserve(writer, sizeof(Value) * chunk->constants.count);
+            size_t code = reserve(writer, chunk->count);
+            size_t lines = reserve(writer, sizeof(int) * chunk->count);
+            // Inline caches start out empty in every process.
+            size_t caches = reserve(writer, sizeof(InlineCache) * chunk->cacheCount);
+            size_t switches = reserve(writer, sizeof(SwitchTable) * chunk->switchCount);
+            memcpy(writer->bytes + offset, function, sizeof(ObjFunction));
+            memcpy(writer->bytes + code, chunk->code, chunk->count);
+            // As compiled: each process that loads the image quickens it afresh.
+            uint8_t* copied = writer->bytes + code;
+            for (int i = 0; i < chunk->count; i += instructionLength(copied[i]))
+                copied[i] = genericOpcode(copied[i]);
+            memcpy(writer->bytes + lines, chunk->lines, sizeof(int) * chunk->count);
+
+            ObjFunction* copy = (ObjFunction*) (writer->bytes + offset);
+            copy->Obj.next = NULL;
+            copy->chunk.capacity = chunk->count;
+            copy->chunk.constants.capacity = chunk->constants.count;
+            copy->chunk.jit = NULL;
+            writePointer(writer, offset + offsetof(ObjFunction, chunk.code), code);
+            writePointer(writer, offset + offsetof(ObjFunction, chunk.lines), lines);
+            writePointer(writer, offset + offsetof(ObjFunction, chunk.constants.values), constants);
+            if (chunk->caches != NULL)
+                writePointer(writer, offset + offsetof(ObjFunction, chunk.caches), caches);
+            if (chunk->switches != NULL)
+                writePointer(writer, offset + offsetof(ObjFunction, chunk.switches), switches);
+
+            // Each switch's offsets or cases go after the tables; the cases'
+            // keys are linked by linkObject().
+            for (int i = 0; i < chunk->switchCount; i++) {
+                SwitchTable* table = &chunk->switches[i];
+                size_t at = switches + sizeof(SwitchTable) * i;
+                memcpy(writer->bytes + at, table, sizeof(SwitchTable));
+                if (table->offsets != NULL) {
+                    size_t offsets = reserve(writer, sizeof(int) * table->count);
+                    memcpy(writer->bytes + offsets, table->offsets, sizeof(int) * table->count);
+                    writePointer(writer, at + offsetof(SwitchTable, offsets), offsets);
+                }
+                if (table->cases.entries != NULL) {
+                    size_t entries = reserve(writer, sizeof(Entry) * table->cases.capacity);
+                    writePointer(writer, at + offsetof(SwitchTable, cases.entries), entries);
+                }
+            }
+            return offset;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            int fieldCount = instance->shape->fieldCount;
+            size_t offset = reserve(writer, sizeof(ObjInstance));
+            reserve(writer, sizeof(Value) * fieldCount);
+            memcpy(writer->bytes + offset, instance, sizeof(ObjInstance));
+
+            ObjInstance* copy = (ObjInstance*) (writer->bytes + offset);
+            copy->Obj.next = NULL;
+            copy->capacity = fieldCount;
+            if (fieldCount == 0) copy->fields = NULL;
+            else writePointer(writer, offset + offsetof(ObjInstance, fields),
+                              offset + IMAGE_ALIGN(sizeof(ObjInstance)));
+            return offset;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) object;
+            size_t offset = reserve(writer, sizeof(ObjList));
+            size_t items = list->packed ? reserve(writer, sizeof(double) * list->numbers.count)
+                                        : reserve(writer, sizeof(Value) * list->items.count);
+            memcpy(writer->bytes + offset, list, sizeof(ObjList));
+
+            ObjList* copy = (ObjList*) (writer->bytes + offset);
+            copy->Obj.next = NULL;
+            if (list->packed) {
+                memcpy(writer->bytes + items, list->numbers.values, sizeof(double) * list->numbers.count);
+                copy->numbers.capacity = list->numbers.count;
+                writePointer(writer, offset + offsetof(ObjList, numbers.values), items);
+            }
+            else {
+                copy->items.capacity = list->items.count;
+                writePointer(writer, offset + offsetof(ObjList, items.values), items);
+            }
+            return offset;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*) object;
+            size_t offset = reserve(writer, sizeof(ObjMap));
+            size_t entries = reserve(writer, sizeof(Entry) * map->table.capacity);
+            memcpy(writer->bytes + offset, map, sizeof(ObjMap));
+
+            ObjMap* copy = (ObjMap*) (writer->bytes + offset);
+            copy->Obj.next = NULL;
+            // Entries holding a native or a fiber are dropped by writeEntries().
+            for (int i = 0; i < map->table.capacity; i++) {
+                Entry* entry = &map->table.entries[i];
+                if (leftOut(entry->key) || leftOut(entry->value)) copy->count--;
+            }
+            if (map->table.entries != NULL)
+                writePointer(writer, offset + offsetof(ObjMap, table.entries), entries);
+            return offset;
+        }
+        case OBJ_FIBER:
+        case OBJ_NATIVE: break; // Never written, see saveImage().
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*) object;
+            size_t offset = reserve(writer, sizeof(ObjShape));
+            size_t transitions = reserve(writer, sizeof(Entry) * shape->transitions.capacity);
+            memcpy(writer->bytes + offset, shape, sizeof(ObjShape));
+            ((ObjShape*) (writer->bytes + offset))->Obj.next = NULL;
+            if (shape->transitions.entries != NULL)
+                writePointer(writer, offset + offsetof(ObjShape, transitions.entries), transitions);
+            return offset;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            size_t offset = reserve(writer, sizeof(ObjString));
+            size_t chars = reserve(writer, string->length + 1);
+            memcpy(writer->bytes + offset, string, sizeof(ObjString));
+            ((ObjString*) (writer->bytes + offset))->Obj.next = NULL;
+            memcpy(writer->bytes + chars, string->chars, string->length + 1);
+            writePointer(writer, offset + offsetof(ObjString, chars), chars);
+            return offset;
+        }
+    }
+    return 0; // Unreachable.
+}
+
+// Where the pointer writePointer() stored at `at` points in the image.
+static size_t pointerOffset(ImageWriter* writer, size_t at){
+    uintptr_t address;
+    memcpy(&address, writer->bytes + at, sizeof(address));
+    return address - IMAGE_BASE;
+}
+
+static void linkValues(ImageWriter* writer, size_t at, Value* values, int count){
+    for (int i = 0; i < count; i++) {
+        // A native held anywhere but in a global can't be defined again; it loads as nil.
+        Value value = leftOut(values[i]) ? NIL_VAL : values[i];
+        writeValue(writer, at + sizeof(Value) * i, value);
+    }
+}
+
+// Points the field at `at` to where `object` went; NULL stays NULL.
+static void linkPointer(ImageWriter* writer, size_t at, void* object){
+    if (object != NULL) writePointer(writer, at, objectOffset(writer, (Obj*) object));
+}
+
+static void linkObject(ImageWriter* writer, ImageObject* placed){
+    size_t at = placed->offset;
+    switch (placed->object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) placed->object;
+            writeValue(writer, at + offsetof(ObjBoundMethod, receiver), bound->receiver);
+            linkPointer(writer, at + offsetof(ObjBoundMethod, method), bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) placed->object;
+            linkPointer(writer, at + offsetof(ObjClass, name), klass->name);
+            linkPointer(writer, at + offsetof(ObjClass, superclass), klass->superclass);
+            linkPointer(writer, at + offsetof(ObjClass, initializer), klass->initializer);
+            linkPointer(writer, at + offsetof(ObjClass, shape), klass->shape);
+            writeEntries(writer, at + IMAGE_ALIGN(sizeof(ObjClass)), &klass->methods);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) placed->object;
+            linkPointer(writer, at + offsetof(ObjFunction, name), function->name);
+            linkPointer(writer, at + offsetof(ObjFunction, owner), function->owner);
+            linkValues(writer, at + IMAGE_ALIGN(sizeof(ObjFunction)),
+                       function->chunk.constants.values, function->chunk.constants.count);
+            for (int i = 0; i < function->chunk.switchCount; i++) {
+                Table* cases = &function->chunk.switches[i].cases;
+                if (cases->entries == NULL) continue;
+                size_t table = pointerOffset(writer, at + offsetof(ObjFunction, chunk.switches))
+                               + sizeof(SwitchTable) * i;
+                writeEntries(writer, pointerOffset(writer, table + offsetof(SwitchTable, cases.entries)), cases);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) placed->object;
+            linkPointer(writer, at + offsetof(ObjInstance, klass), instance->klass);
+            linkPointer(writer, at + offsetof(ObjInstance, shape), instance->shape);
+            linkValues(writer, at + IMAGE_ALIGN(sizeof(ObjInstance)),
+                       instance->fields, instance->shape->fieldCount);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) placed->object;
+            if (!list->packed)
+                linkValues(writer, at + IMAGE_ALIGN(sizeof(ObjList)), list->items.values, list->items.count);
+            break;
+        }
+        case OBJ_MAP:
+            writeEntries(writer, at + IMAGE_ALIGN(sizeof(ObjMap)), &((ObjMap*) placed->object)->table);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*) placed->object;
+            linkPointer(writer, at + offsetof(ObjShape, parent), shape->parent);
+            linkPointer(writer, at + offsetof(ObjShape, name), shape->name);
+            writeEntries(writer, at + IMAGE_ALIGN(sizeof(ObjShape)), &shape->transitions);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void writeValue(ImageWriter* writer, size_t at, Value value){
+    memcpy(writer->bytes + at, &value, sizeof(Value));
+    if (IS_OBJ(value))
+        writePointer(writer, at + offsetof(Value, as), objectOffset(writer, AS_OBJ(value)));
+}
+
+static void writeEntries(ImageWriter* writer, size_t offset, Table* table){
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        size_t at = offset + sizeof(Entry) * i;
+        if (leftOut(entry->key) || leftOut(entry->value)) {
+            // Left as a tombstone for the loading VM to define again.
+            writeValue(writer, at + offsetof(Entry, key), NIL_VAL);
+            writeValue(writer, at + offsetof(Entry, value), BOOL_VAL(true));
+            continue;
+        }
+        writeValue(writer, at + offsetof(Entry, key), entry->key);
+        writeValue(writer, at + offsetof(Entry, value), entry->value);
+    }
+}
+
+static size_t writeTable(ImageWriter* writer, Table* table){
+    size_t offset = reserve(writer, sizeof(Entry) * table->capacity);
+    writeEntries(writer, offset, table);
+    return offset;
+}
+
+bool saveImage(VM* vm, const char* path){
+    // Natives point into this process's code, which moves from run to run, so
+    // they're left out. So are fibers, which are caught mid-run. Objects that
+    // aren't on vm->objects couldn't be found when translating pointers.
+    if (vm->sharedStrings != NULL || vm->image != NULL) {
+        fprintf(stderr, "Can't save an image of a VM with shared strings or a loaded image.\n");
+        return false;
+    }
+    TIMELINE_BEGIN("saveImage");
+
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(ImageWriter));
+    size_t header = reserve(&writer, sizeof(ImageHeader));
+
+    for (Obj* object = vm->objects; object != NULL; object = object->next)
+        if (!leftOutObject(object)) writer.objectCount++;
+    writer.objects = ALLOCATE(ImageObject, writer.objectCount);
+    int index = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (leftOutObject(object)) continue;
+        writer.objects[index].object = object;
+        writer.objects[index].offset = layoutObject(&writer, object);
+        index++;
+    }
+    qsort(writer.objects, writer.objectCount, sizeof(ImageObject), compareObjects);
+    for (int i = 0; i < writer.objectCount; i++) linkObject(&writer, &writer.objects[i]);
+
+    ImageHeader fields;
+    memset(&fields, 0, sizeof(ImageHeader));
+    memcpy(fields.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    fields.version = IMAGE_VERSION;
+    fields.valueSize = sizeof(Value);
+    fields.stringSize = sizeof(ObjString);
+    fields.entrySize = sizeof(Entry);
+    fields.base = IMAGE_BASE;
+    fields.globals = writeTable(&writer, &vm->globals);
+    fields.globalsCount = vm->globals.count;
+    fields.globalsCapacity = vm->globals.capacity;
+    fields.strings = writeTable(&writer, &vm->strings);
+    fields.stringsCount = vm->strings.count;
+    fields.stringsCapacity = vm->strings.capacity;
+    fields.relocationCount = writer.relocationCount;
+    fields.relocations = reserve(&writer, sizeof(uint64_t) * writer.relocationCount);
+    memcpy(writer.bytes + fields.relocations, writer.relocations,
+           sizeof(uint64_t) * writer.relocationCount);
+    fields.size = writer.count;
+    memcpy(writer.bytes + header, &fields, sizeof(ImageHeader));
+
+    bool saved = false;
+    FILE* file = fopen(path, "wb");
+    if (file != NULL) {
+        saved = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+        saved = fclose(file) == 0 && saved;
+    }
+    if (!saved) fprintf(stderr, "Could not write image %s.\n", path);
+
+    FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+    FREE_ARRAY(uint64_t, writer.relocations, writer.relocationCapacity);
+    FREE_ARRAY(ImageObject, writer.objects, writer.objectCount);
+    TIMELINE_END("saveImage");
+    return saved;
+}
+
+/**************************************/
+
+/*********      Loading       *********/
+
+static void* mapImage(int fd, size_t size){
+    void* image = mmap((void*) IMAGE_BASE, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (image != MAP_FAILED) return image;
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+}
+
+static void loadTable(Table* table, uint8_t* image, uint64_t offset, int count, int capacity){
+    table->entries = ALLOCATE(Entry, capacity);
+    memcpy(table->entries, image + offset, sizeof(Entry) * capacity);
+    table->count = count;
+    table->capacity = capacity;
+}
+
+bool loadImage(VM* vm, const char* path){
+    TIMELINE_BEGIN("loadImage");
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    ImageHeader header;
+    if (fd == -1 || fstat(fd, &status) == -1
+        || pread(fd, &header, sizeof(ImageHeader), 0) != sizeof(ImageHeader)) {
+        fprintf(stderr, "Could not read image %s.\n", path);
+        if (fd != -1) close(fd);
+        return false;
+    }
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0
+        || header.version != IMAGE_VERSION
+        || header.valueSize != sizeof(Value)
+        || header.stringSize != sizeof(ObjString)
+        || header.entrySize != sizeof(Entry)
+        || header.size != (uint64_t) status.st_size) {
+        fprintf(stderr, "%s is not an image for this build of clox.\n", path);
+        close(fd);
+        return false;
+    }
+
+    uint8_t* image = mapImage(fd, header.size);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Could not map image %s.\n", path);
+        return false;
+    }
+
+    uintptr_t delta = (uintptr_t) image - header.base;
+    if (delta != 0) {
+        uint64_t* relocations = (uint64_t*) (image + header.relocations);
+        for (uint64_t i = 0; i < header.relocationCount; i++)
+            *(uintptr_t*) (image + relocations[i]) += delta;
+    }
+    TIMELINE_INSTANT("image relocated", delta != 0);
+
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
+    loadTable(&vm->globals, image, header.globals, header.globalsCount, header.globalsCapacity);
+    loadTable(&vm->strings, image, header.strings, header.stringsCount, header.stringsCapacity);
+    vm->image = image;
+    vm->imageSize = header.size;
+    TIMELINE_END("loadImage");
+    return true;
+}
+
+bool inImage(VM* vm, const void* pointer){
+    const uint8_t* image = vm->image;
+    return image != NULL && (const uint8_t*) pointer >= image
+           && (const uint8_t*) pointer < image + vm->imageSize;
+}
+
+void keepImageJit(VM* vm, Chunk* chunk){
+    if (vm->imageJitCapacity < vm->imageJitCount + 1) {
+        int oldCapacity = vm->imageJitCapacity;
+        vm->imageJitCapacity = GROW_CAPACITY(oldCapacity);
+        vm->imageJit = GROW_ARRAY(Chunk*, vm->imageJit, oldCapacity, vm->imageJitCapacity);
+    }
+    vm->imageJit[vm->imageJitCount++] = chunk;
+}
+
+void freeImage(VM* vm){
+    for (int i = 0; i < vm->imageJitCount; i++) jitFree(vm->imageJit[i]->jit);
+    FREE_ARRAY(Chunk*, vm->imageJit, vm->imageJitCapacity);
+    vm->imageJit = NULL;
+    vm->imageJitCount = 0;
+    vm->imageJitCapacity = 0;
+    if (vm->image != NULL) munmap(vm->image, vm->imageSize);
+    vm->image = NULL;
+    vm->imageSize = 0;
+}
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "timeline.h"
+
+static InternArray* allocateArray(int capacity){
+    InternArray* array = (InternArray*) reallocate(NULL, 0,
+            sizeof(InternArray) + sizeof(ObjString*) * capacity);
+    array->capacity = capacity;
+    array->retired = NULL;
+    for (int i = 0; i < capacity; i++) atomic_init(&array->entries[i], NULL);
+    return array;
+}
+
+static void freeArray(InternArray* array){
+    reallocate(array, sizeof(InternArray) + sizeof(ObjString*) * array->capacity, 0);
+}
+
+void initInternTable(InternTable* table){
+    atomic_init(&table->array, allocateArray(GROW_CAPACITY(0)));
+    atomic_init(&table->count, 0);
+    for (int i = 0; i < INTERN_STRIPES; i++) pthread_mutex_init(&table->stripes[i], NULL);
+}
+
+void freeInternTable(InternTable* table){
+    InternArray* array = atomic_load(&table->array);
+    for (int i = 0; i < array->capacity; i++) {
+        ObjString* string = atomic_load_explicit(&array->entries[i], memory_order_relaxed);
+        if (string == NULL) continue;
+        FREE_ARRAY(char, string->chars, string->length + 1);
+        FREE(ObjString, string);
+    }
+
+    while (array != NULL) {
+        InternArray* retired = array->retired;
+        freeArray(array);
+        array = retired;
+    }
+    for (int i = 0; i < INTERN_STRIPES; i++) pthread_mutex_destroy(&table->stripes[i]);
+}
+
+ObjString* internFind(InternTable* table, const char* chars, int length, uint32_t hash){
+    InternArray* array = atomic_load_explicit(&table->array, memory_order_acquire);
+    // Capacities are powers of two.
+    uint32_t mask = (uint32_t) array->capacity - 1;
+
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        ObjString* string = atomic_load_explicit(&array->entries[index], memory_order_acquire);
+        if (string == NULL) return NULL;
+        if (string->hash == hash && string->length == length
+            && memcmp(string->chars, chars, length) == 0)
+            return string;
+    }
+}
+
+// Claims the first empty slot on the string's probe sequence.
+static void place(InternArray* array, ObjString* string){
+    uint32_t mask = (uint32_t) array->capacity - 1;
+    for (uint32_t index = string->hash & mask;; index = (index + 1) & mask) {
+        ObjString* empty = NULL;
+        if (atomic_compare_exchange_strong_explicit(&array->entries[index], &empty, string,
+                                                    memory_order_release, memory_order_relaxed))
+            return;
+    }
+}
+
+// Counts one more entry unless that would push the array past its load limit.
+static bool reserve(InternTable* table, InternArray* array){
+    int count = atomic_load_explicit(&table->count, memory_order_relaxed);
+    do {
+        if (count + 1 > array->capacity * INTERN_MAX_LOAD) return false;
+    } while (!atomic_compare_exchange_weak_explicit(&table->count, &count, count + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+static void grow(InternTable* table, InternArray* full){
+    for (int i = 0; i < INTERN_STRIPES; i++) pthread_mutex_lock(&table->stripes[i]);
+
+    // Another thread may have grown the table while we waited for the stripes.
+    if (atomic_load_explicit(&table->array, memory_order_relaxed) == full) {
+        TIMELINE_BEGIN("internGrow");
+        InternArray* array = allocateArray(GROW_CAPACITY(full->capacity));
+        for (int i = 0; i < full->capacity; i++) {
+            ObjString* string = atomic_load_explicit(&full->entries[i], memory_order_relaxed);
+            if (string != NULL) place(array, string);
+        }
+        array->retired = full;
+        atomic_store_explicit(&table->array, array, memory_order_release);
+        TIMELINE_END("internGrow");
+    }
+
+    for (int i = INTERN_STRIPES - 1; i >= 0; i--) pthread_mutex_unlock(&table->stripes[i]);
+}
+
+ObjString* internAdd(InternTable* table, ObjString* string){
+    pthread_mutex_t* stripe = &table->stripes[string->hash & (INTERN_STRIPES - 1)];
+    ObjString* interned;
+
+    pthread_mutex_lock(stripe);
+    while (true) {
+        // Equal strings share a stripe, so no one else can be adding this one now.
+        interned = internFind(table, string->chars, string->length, string->hash);
+        if (interned != NULL) break;
+
+        // The array can't be replaced while we hold a stripe.
+        InternArray* array = atomic_load_explicit(&table->array, memory_order_relaxed);
+        if (reserve(table, array)) {
+            place(array, string);
+            interned = string;
+            break;
+        }
+
+        pthread_mutex_unlock(stripe);
+        grow(table, array);
+        pthread_mutex_lock(stripe);
+    }
+    pthread_mutex_unlock(stripe);
+    return interned;
+}
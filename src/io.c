@@ -0,0 +1,451 @@
+// For accept4() and pipe2().
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "vm.h"
+#include "fiber.h"
+#include "memory.h"
+
+// Events taken from the epoll instance per poll.
+#define IO_EVENTS 64
+// The most bytes one read() asks for.
+#define IO_READ_MAX (1 << 24)
+
+void initIoLoop(IoLoop* io){
+    io->epoll = -1;
+    io->waiting = 0;
+    io->sincePoll = 0;
+    io->descriptors = NULL;
+    io->capacity = 0;
+}
+
+void freeIoLoop(IoLoop* io){
+    if (io->epoll != -1) close(io->epoll);
+    FREE_ARRAY(IoDescriptor, io->descriptors, io->capacity);
+    initIoLoop(io);
+}
+
+void forgetIoLoop(IoLoop* io){
+    // Nothing is parked between scripts, so there are no registrations to lose.
+    if (io->epoll != -1) close(io->epoll);
+    io->epoll = -1;
+}
+
+/*********     Operations     *********/
+
+static bool wouldBlock(){
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// send() so a closed socket is an error instead of a SIGPIPE; pipes need write().
+static ssize_t writeSome(int fd, const char* bytes, size_t count){
+    ssize_t written = send(fd, bytes, count, MSG_NOSIGNAL);
+    if (written < 0 && errno == ENOTSOCK) written = write(fd, bytes, count);
+    return written;
+}
+
+/* Tries the operation once. Returns true with its result once it has
+ * finished, successfully (a string, a count, a descriptor) or not (nil), and
+ * false when it has to wait for the descriptor. */
+static bool attempt(VM* vm, int fd, IoWait* wait, Value* result){
+    switch (wait->operation) {
+        case IO_READ: {
+            int capacity = wait->count + 1;
+            char* chars = ALLOCATE(char, capacity);
+            ssize_t bytesRead = read(fd, chars, wait->count);
+            if (bytesRead < 0) {
+                FREE_ARRAY(char, chars, capacity);
+                if (wouldBlock()) return false;
+                *result = NIL_VAL;
+                return true;
+            }
+            int length = (int) bytesRead;
+            int size = length + 1;
+            chars = GROW_ARRAY(char, chars, capacity, size);
+            chars[length] = '\0';
+            *result = OBJ_VAL(takeString(vm, chars, length));
+            return true;
+        }
+        case IO_WRITE: {
+            ObjString* data = wait->data;
+            while (wait->count < data->length) {
+                ssize_t written = writeSome(fd, data->chars + wait->count, data->length - wait->count);
+                if (written < 0) {
+                    if (wouldBlock()) return false;
+                    *result = NIL_VAL;
+                    return true;
+                }
+                wait->count += (int) written;
+            }
+            *result = NUMBER_VAL(data->length);
+            return true;
+        }
+        case IO_ACCEPT: {
+            int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0) {
+                // A connection that was reset before we got to it just isn't there.
+                if (wouldBlock() || errno == ECONNABORTED) return false;
+                *result = NIL_VAL;
+                return true;
+            }
+            *result = NUMBER_VAL(client);
+            return true;
+        }
+        case IO_CONNECT: {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                close(fd);
+                *result = NIL_VAL;
+                return true;
+            }
+            *result = NUMBER_VAL(fd);
+            return true;
+        }
+    }
+    return true; // Unreachable.
+}
+
+static IoWait* waitSlot(IoDescriptor* descriptor, IoOperation operation){
+    return operation == IO_READ || operation == IO_ACCEPT ? &descriptor->reader : &descriptor->writer;
+}
+
+// Registers the descriptor for whatever its parked operations wait on.
+static bool updateInterest(IoLoop* io, int fd){
+    IoDescriptor* descriptor = &io->descriptors[fd];
+    uint32_t events = (descriptor->reader.fiber != NULL ? EPOLLIN : 0)
+                      | (descriptor->writer.fiber != NULL ? EPOLLOUT : 0);
+    if (events == descriptor->events) return true;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    int status;
+    if (events == 0) status = epoll_ctl(io->epoll, EPOLL_CTL_DEL, fd, NULL);
+    else status = epoll_ctl(io->epoll, descriptor->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    if (status == -1 && events != 0) return false;
+    descriptor->events = events;
+    return true;
+}
+
+// Makes room in the table for `fd` and the epoll instance, if need be.
+static bool prepare(IoLoop* io, int fd){
+    if (io->epoll == -1) io->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epoll == -1) return false;
+    if (fd < io->capacity) return true;
+
+    int capacity = io->capacity < 8 ? 8 : io->capacity;
+    while (capacity <= fd) capacity *= 2;
+    io->descriptors = GROW_ARRAY(IoDescriptor, io->descriptors, io->capacity, capacity);
+    memset(&io->descriptors[io->capacity], 0, sizeof(IoDescriptor) * (capacity - io->capacity));
+    io->capacity = capacity;
+    return true;
+}
+
+// Parks the running fiber until the operation can go on.
+static bool park(VM* vm, int fd, IoWait* wait, Value* result){
+    IoLoop* io = &vm->io;
+    if (!prepare(io, fd)) {
+        *result = NIL_VAL;
+        return true;
+    }
+    IoWait* slot = waitSlot(&io->descriptors[fd], wait->operation);
+    if (slot->fiber != NULL) {
+        runtimeError(vm, "Another fiber is already %s descriptor %d.",
+                     slot == &io->descriptors[fd].reader ? "reading from" : "writing to", fd);
+        return false;
+    }
+    *slot = *wait;
+    if (!updateInterest(io, fd)) {
+        // epoll can't watch it (a regular file, say), so it can't be waited for.
+        slot->fiber = NULL;
+        *result = NIL_VAL;
+        return true;
+    }
+    io->waiting++;
+    blockFiber(vm, result);
+    return true;
+}
+
+// Runs the operation now if it can, or parks the fiber until it can.
+static bool perform(VM* vm, int fd, IoWait* wait, Value* result){
+    if (attempt(vm, fd, wait, result)) return true;
+    return park(vm, fd, wait, result);
+}
+
+// Queues a parked operation's fiber with its result.
+static void finish(VM* vm, IoWait* slot, Value result){
+    ObjFiber* fiber = slot->fiber;
+    slot->fiber = NULL;
+    vm->io.waiting--;
+    wakeFiber(vm, fiber, result);
+}
+
+static void retry(VM* vm, int fd, IoWait* slot){
+    Value result;
+    if (slot->fiber != NULL && attempt(vm, fd, slot, &result)) finish(vm, slot, result);
+}
+
+// Gives every fiber parked on `fd` nil.
+static void abandon(VM* vm, int fd){
+    IoDescriptor* descriptor = &vm->io.descriptors[fd];
+    if (descriptor->reader.fiber != NULL) finish(vm, &descriptor->reader, NIL_VAL);
+    if (descriptor->writer.fiber != NULL) finish(vm, &descriptor->writer, NIL_VAL);
+    updateInterest(&vm->io, fd);
+}
+
+void pollIo(VM* vm, bool block){
+    IoLoop* io = &vm->io;
+    io->sincePoll = 0;
+    if (io->waiting == 0) return;
+
+    struct epoll_event events[IO_EVENTS];
+    int count = epoll_wait(io->epoll, events, IO_EVENTS, block ? -1 : 0);
+    if (count == -1) {
+        if (errno == EINTR) return;
+        // The loop itself is broken; nothing parked would ever finish.
+        for (int fd = 0; fd < io->capacity; fd++) abandon(vm, fd);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ready = events[i].events;
+        IoDescriptor* descriptor = &io->descriptors[fd];
+        // Errors and hangups are for the operation itself to report.
+        if (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) retry(vm, fd, &descriptor->reader);
+        if (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) retry(vm, fd, &descriptor->writer);
+        updateInterest(io, fd);
+    }
+}
+
+void cancelIo(VM* vm){
+    for (int fd = 0; fd < vm->io.capacity && vm->io.waiting > 0; fd++) abandon(vm, fd);
+}
+
+/**************************************/
+
+/*********      Natives       *********/
+
+static bool descriptorArg(VM* vm, Value value, const char* name, int* fd){
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+    if (!(number >= 0 && number <= INT32_MAX) || number != (int) number) {
+        runtimeError(vm, "%s() expects a file descriptor.", name);
+        return false;
+    }
+    *fd = (int) number;
+    return true;
+}
+
+static bool stringArg(VM* vm, Value value, const char* name, const char* what){
+    if (!IS_STRING(value)) {
+        runtimeError(vm, "%s() expects %s.", name, what);
+        return false;
+    }
+    return true;
+}
+
+static bool portArg(VM* vm, Value value, const char* name, int* port){
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+    if (!(number >= 0 && number <= 65535) || number != (int) number) {
+        runtimeError(vm, "%s() expects a port between 0 and 65535.", name);
+        return false;
+    }
+    *port = (int) number;
+    return true;
+}
+
+static bool openFileNative(VM* vm, int argCount, Value* args){
+    if (!stringArg(vm, args[0], "openFile", "a path") || !stringArg(vm, args[1], "openFile", "a mode")) return false;
+    const char* mode = AS_CSTRING(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0) flags = O_RDONLY;
+    else if (strcmp(mode, "w") == 0) flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (strcmp(mode, "a") == 0) flags = O_WRONLY | O_CREAT | O_APPEND;
+    else {
+        runtimeError(vm, "openFile() expects a mode of \"r\", \"w\" or \"a\".");
+        return false;
+    }
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    args[-1] = fd == -1 ? NIL_VAL : NUMBER_VAL(fd);
+    return true;
+}
+
+static bool pipeNative(VM* vm, int argCount, Value* args){
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    // Writing to a pipe nobody reads any more should fail, not end the process.
+    signal(SIGPIPE, SIG_IGN);
+    ObjList* list = newList(vm);
+    listAppend(vm, list, NUMBER_VAL(fds[0]));
+    listAppend(vm, list, NUMBER_VAL(fds[1]));
+    args[-1] = OBJ_VAL(list);
+    return true;
+}
+
+static bool readNative(VM* vm, int argCount, Value* args){
+    int fd;
+    if (!descriptorArg(vm, args[0], "read", &fd)) return false;
+    double count = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : 0;
+    if (!(count >= 1 && count <= IO_READ_MAX)) {
+        runtimeError(vm, "read() expects a byte count between 1 and %d.", IO_READ_MAX);
+        return false;
+    }
+    IoWait wait = {vm->fiber, IO_READ, (int) count, NULL};
+    return perform(vm, fd, &wait, &args[-1]);
+}
+
+static bool writeNative(VM* vm, int argCount, Value* args){
+    int fd;
+    if (!descriptorArg(vm, args[0], "write", &fd) || !stringArg(vm, args[1], "write", "a string")) return false;
+    IoWait wait = {vm->fiber, IO_WRITE, 0, AS_STRING(args[1])};
+    return perform(vm, fd, &wait, &args[-1]);
+}
+
+static bool closeNative(VM* vm, int argCount, Value* args){
+    int fd;
+    if (!descriptorArg(vm, args[0], "close", &fd)) return false;
+    if (fd < vm->io.capacity) abandon(vm, fd);
+    args[-1] = BOOL_VAL(close(fd) == 0);
+    return true;
+}
+
+// Binds and listens, or gives nil.
+static void listenOn(int fd, struct sockaddr* address, socklen_t length, Value* result){
+    if (fd == -1) {
+        *result = NIL_VAL;
+        return;
+    }
+    if (bind(fd, address, length) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        *result = NIL_VAL;
+        return;
+    }
+    *result = NUMBER_VAL(fd);
+}
+
+static bool connectTo(VM* vm, int fd, struct sockaddr* address, socklen_t length, Value* result){
+    if (fd == -1) {
+        *result = NIL_VAL;
+        return true;
+    }
+    if (connect(fd, address, length) == 0) {
+        *result = NUMBER_VAL(fd);
+        return true;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        *result = NIL_VAL;
+        return true;
+    }
+    IoWait wait = {vm->fiber, IO_CONNECT, 0, NULL};
+    return park(vm, fd, &wait, result);
+}
+
+static bool unixAddress(VM* vm, Value path, const char* name, struct sockaddr_un* address){
+    if (!stringArg(vm, path, name, "a socket path")) return false;
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (AS_STRING(path)->length >= (int) sizeof(address->sun_path)) {
+        runtimeError(vm, "%s() socket path is too long.", name);
+        return false;
+    }
+    memcpy(address->sun_path, AS_CSTRING(path), AS_STRING(path)->length);
+    return true;
+}
+
+// The TCP natives only ever use the loopback interface.
+static void loopbackAddress(int port, struct sockaddr_in* address){
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t) port);
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static int newSocket(int domain){
+    return socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+static bool listenUnixNative(VM* vm, int argCount, Value* args){
+    struct sockaddr_un address;
+    if (!unixAddress(vm, args[0], "listenUnix", &address)) return false;
+    // Like --serve, take over a socket left behind by an earlier run, but nothing else.
+    struct stat status;
+    if (stat(address.sun_path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(address.sun_path);
+    listenOn(newSocket(AF_UNIX), (struct sockaddr*) &address, sizeof(address), &args[-1]);
+    return true;
+}
+
+static bool connectUnixNative(VM* vm, int argCount, Value* args){
+    struct sockaddr_un address;
+    if (!unixAddress(vm, args[0], "connectUnix", &address)) return false;
+    return connectTo(vm, newSocket(AF_UNIX), (struct sockaddr*) &address, sizeof(address), &args[-1]);
+}
+
+static bool listenTcpNative(VM* vm, int argCount, Value* args){
+    int port;
+    if (!portArg(vm, args[0], "listenTcp", &port)) return false;
+    struct sockaddr_in address;
+    loopbackAddress(port, &address);
+    int fd = newSocket(AF_INET);
+    int reuse = 1;
+    if (fd != -1) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    listenOn(fd, (struct sockaddr*) &address, sizeof(address), &args[-1]);
+    return true;
+}
+
+static bool connectTcpNative(VM* vm, int argCount, Value* args){
+    int port;
+    if (!portArg(vm, args[0], "connectTcp", &port)) return false;
+    struct sockaddr_in address;
+    loopbackAddress(port, &address);
+    return connectTo(vm, newSocket(AF_INET), (struct sockaddr*) &address, sizeof(address), &args[-1]);
+}
+
+// The port a TCP socket ended up on, for listenTcp(0).
+static bool localPortNative(VM* vm, int argCount, Value* args){
+    int fd;
+    if (!descriptorArg(vm, args[0], "localPort", &fd)) return false;
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*) &address, &length) == -1 || address.sin_family != AF_INET)
+        args[-1] = NIL_VAL;
+    else args[-1] = NUMBER_VAL(ntohs(address.sin_port));
+    return true;
+}
+
+static bool acceptNative(VM* vm, int argCount, Value* args){
+    int fd;
+    if (!descriptorArg(vm, args[0], "accept", &fd)) return false;
+    IoWait wait = {vm->fiber, IO_ACCEPT, 0, NULL};
+    return perform(vm, fd, &wait, &args[-1]);
+}
+
+void defineIoNatives(VM* vm){
+    defineNative(vm, "openFile", openFileNative, 2);
+    defineNative(vm, "pipe", pipeNative, 0);
+    defineNative(vm, "read", readNative, 2)->switchesFiber = true;
+    defineNative(vm, "write", writeNative, 2)->switchesFiber = true;
+    defineNative(vm, "close", closeNative, 1);
+    defineNative(vm, "listenUnix", listenUnixNative, 1);
+    defineNative(vm, "connectUnix", connectUnixNative, 1)->switchesFiber = true;
+    defineNative(vm, "listenTcp", listenTcpNative, 1);
+    defineNative(vm, "connectTcp", connectTcpNative, 1)->switchesFiber = true;
+    defineNative(vm, "localPort", localPortNative, 1);
+    defineNative(vm, "accept", acceptNative, 1)->switchesFiber = true;
+}
+
+/**************************************/
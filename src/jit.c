@@ -0,0 +1,780 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+_Static_assert(sizeof(Value) == 16, "The JIT assumes 16 byte values.");
+_Static_assert(offsetof(Value, as) == 8, "The JIT assumes the payload at offset 8.");
+
+#define VALUE_SIZE ((int) sizeof(Value))
+#define PAYLOAD ((int) offsetof(Value, as))
+#define STACK_TOP_FIELD ((int) offsetof(VM, stackTop))
+#define SLOTS_FIELD ((int) offsetof(VM, slots))
+#define CHUNK_FIELD ((int) offsetof(VM, chunk))
+#define CONSTANTS_FIELD ((int) offsetof(Chunk, constants.values))
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+enum { XMM0 = 0 };
+
+/* Registers pinned for the whole of the generated code, loaded from the VM
+ * on entry. All are callee-saved, so they survive calls into the C helpers
+ * below. */
+#define STACK_TOP RBX   // vm->stackTop, written back around helper calls
+#define SLOTS R12       // vm->slots, the locals' base
+#define VM_BASE R13     // the VM, passed as every helper's first argument
+#define CONSTANTS R14   // chunk->constants.values
+
+#define OP_MOV_LOAD 0x8B
+#define OP_MOV_STORE 0x89
+#define OP_LEA 0x8D
+#define OP_XOR_STORE 0x31
+#define OP_MOVE_SSE_LOAD 0x0F10
+#define OP_MOVE_SSE_STORE 0x0F11
+#define OP_ADD_SD 0x0F58
+#define OP_MUL_SD 0x0F59
+#define OP_SUB_SD 0x0F5C
+#define OP_DIV_SD 0x0F5E
+#define OP_UCOMI_SD 0x0F2E
+
+#define JUMP 0xE9
+#define JUMP_EQUAL 0x0F84
+#define JUMP_NOT_EQUAL 0x0F85
+
+struct JitCode {
+    uint8_t* code;
+    size_t size;
+    // Native offset of each bytecode offset, or -1 if no instruction starts there.
+    int* starts;
+    int count;
+};
+
+typedef struct {
+    int at;
+    int target;
+} Fixup;
+
+typedef struct {
+    int count;
+    int capacity;
+    Fixup* fixups;
+} FixupArray;
+
+typedef struct {
+    Chunk* chunk;
+    uint8_t* code;
+    int count;
+    int capacity;
+    // Native offset of each bytecode offset, or -1 if no instruction starts there.
+    int* instructionStart;
+    FixupArray jumps;
+    FixupArray bails;
+    FixupArray exits;
+} Assembler;
+
+/*********      Helpers       *********/
+
+/* Called from generated code for everything that isn't plain numeric work.
+ * The ones returning bool leave the VM untouched when they return false, so
+ * the interpreter can re-execute the instruction and report the error. */
+
+static void defineGlobalHelper(VM* vm, ObjString* name){
+    tableSet(&vm->globals, name, vm->stackTop[-1]);
+    pop(vm);
+}
+
+static bool getGlobalHelper(VM* vm, ObjString* name){
+    Value value;
+    if (!tableGet(&vm->globals, name, &value)) return false;
+    push(vm, value);
+    return true;
+}
+
+static bool setGlobalHelper(VM* vm, ObjString* name){
+    if (tableSet(&vm->globals, name, vm->stackTop[-1])) {
+        tableDelete(&vm->globals, name);
+        return false;
+    }
+    return true;
+}
+
+static bool concatenateHelper(VM* vm, Value* a, Value* b, Value* result){
+    if (!IS_STRING(*a) || !IS_STRING(*b)) return false;
+    *result = OBJ_VAL(concatenateStrings(vm, AS_STRING(*a), AS_STRING(*b)));
+    return true;
+}
+
+static bool addHelper(VM* vm){
+    Value result;
+    if (!concatenateHelper(vm, &vm->stackTop[-2], &vm->stackTop[-1], &result)) return false;
+    vm->stackTop -= 2;
+    push(vm, result);
+    return true;
+}
+
+static bool addRegistersHelper(VM* vm, Value* a, Value* b){
+    Value result;
+    if (!concatenateHelper(vm, a, b, &result)) return false;
+    push(vm, result);
+    return true;
+}
+
+static void equalHelper(VM* vm){
+    Value b = pop(vm);
+    Value a = pop(vm);
+    push(vm, BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void equalRegistersHelper(VM* vm, Value* a, Value* b){
+    push(vm, BOOL_VAL(valuesEqual(*a, *b)));
+}
+
+static void notHelper(VM* vm){
+    vm->stackTop[-1] = BOOL_VAL(isFalsey(vm->stackTop[-1]));
+}
+
+static bool falseyHelper(VM* vm, Value* value){
+    return isFalsey(*value);
+}
+
+typedef enum {
+    CALL_DONE,
+    CALL_FAILED,
+    // A Lox function is running now, or another fiber: go on from vm->ip.
+    CALL_SWITCHED,
+} CallStatus;
+
+static CallStatus callHelper(VM* vm, int argCount, uint8_t* ip){
+    Value callee = vm->stackTop[-1 - argCount];
+    int frameCount = vm->frameCount;
+    ObjFiber* fiber = vm->fiber;
+    vm->ip = ip;
+    if (!callValue(vm, callee, argCount)) return CALL_FAILED;
+    return vm->frameCount == frameCount && vm->fiber == fiber ? CALL_DONE : CALL_SWITCHED;
+}
+
+// Returns to the calling frame. A fiber's first frame is left to run().
+static bool returnHelper(VM* vm){
+    if (vm->frameCount == 1) return false;
+    Value result = pop(vm);
+    vm->frameCount--;
+    vm->stackTop = vm->slots;
+    push(vm, result);
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    vm->chunk = frame->chunk;
+    vm->ip = frame->ip;
+    vm->slots = frame->slots;
+    return true;
+}
+
+static void printHelper(VM* vm){
+    printOutput(&vm->output, pop(vm));
+}
+
+/**************************************/
+
+/*********      Encoding      *********/
+
+static void writeFixup(FixupArray* array, int at, int target){
+    if (array->capacity < array->count + 1) {
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->fixups = GROW_ARRAY(Fixup, array->fixups, oldCapacity, array->capacity);
+    }
+    array->fixups[array->count].at = at;
+    array->fixups[array->count].target = target;
+    array->count++;
+}
+
+static void emit8(Assembler* as, uint8_t byte){
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value){
+    for (int i = 0; i < 4; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value){
+    for (int i = 0; i < 8; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler* as, int at, int32_t value){
+    for (int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t) value >> (8 * i)) & 0xff;
+}
+
+static void emitRex(Assembler* as, bool wide, int reg, int base){
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+    if (rex != 0x40) emit8(as, rex);
+}
+
+// An instruction with a [base + disp32] operand; reg is the ModRM reg field.
+static void emitMemory(Assembler* as, uint8_t prefix, bool wide, uint16_t opcode,
+                       int reg, int base, int32_t disp){
+    if (prefix != 0) emit8(as, prefix);
+    emitRex(as, wide, reg, base);
+    if (opcode > 0xff) emit8(as, opcode >> 8);
+    emit8(as, opcode & 0xff);
+    emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit8(as, 0x24);
+    emit32(as, (uint32_t) disp);
+}
+
+static void emitLoadDouble(Assembler* as, int xmm, int base, int32_t disp){
+    emitMemory(as, 0xF2, false, OP_MOVE_SSE_LOAD, xmm, base, disp);
+}
+
+static void emitStoreDouble(Assembler* as, int xmm, int base, int32_t disp){
+    emitMemory(as, 0xF2, false, OP_MOVE_SSE_STORE, xmm, base, disp);
+}
+
+static void emitCopyValue(Assembler* as, int fromBase, int32_t from, int toBase, int32_t to){
+    emitMemory(as, 0, false, OP_MOVE_SSE_LOAD, XMM0, fromBase, from);
+    emitMemory(as, 0, false, OP_MOVE_SSE_STORE, XMM0, toBase, to);
+}
+
+static void emitStoreImmediate(Assembler* as, bool wide, int base, int32_t disp, int32_t value){
+    emitMemory(as, 0, wide, 0xC7, 0, base, disp);
+    emit32(as, (uint32_t) value);
+}
+
+static void emitCompareType(Assembler* as, int base, int32_t disp, ValueType type){
+    emitMemory(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, (uint32_t) type);
+}
+
+static void emitAdjustStack(Assembler* as, int values){
+    emitRex(as, true, 0, STACK_TOP);
+    emit8(as, 0x81);
+    emit8(as, 0xC0 | ((values < 0 ? 5 : 0) << 3) | (STACK_TOP & 7));
+    emit32(as, (uint32_t) (abs(values) * VALUE_SIZE));
+}
+
+static void emitMoveImmediate(Assembler* as, int reg, uint64_t value){
+    emitRex(as, true, 0, reg);
+    emit8(as, 0xB8 + (reg & 7));
+    emit64(as, value);
+}
+
+static void emitPointerArgument(Assembler* as, int reg, int base, int32_t disp){
+    emitMemory(as, 0, true, OP_LEA, reg, base, disp);
+}
+
+static void emitCall(Assembler* as, void* function){
+    emitMemory(as, 0, true, OP_MOV_STORE, STACK_TOP, VM_BASE, STACK_TOP_FIELD);
+    // mov rdi, r13
+    emitRex(as, true, VM_BASE, RDI);
+    emit8(as, OP_MOV_STORE);
+    emit8(as, 0xC0 | ((VM_BASE & 7) << 3) | (RDI & 7));
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) function);
+    emit8(as, 0xFF);
+    emit8(as, 0xD0);
+    emitMemory(as, 0, true, OP_MOV_LOAD, STACK_TOP, VM_BASE, STACK_TOP_FIELD);
+}
+
+// Emits a jump with an unresolved rel32 and returns where it lives.
+static int emitJumpPlaceholder(Assembler* as, uint16_t opcode){
+    if (opcode > 0xff) emit8(as, opcode >> 8);
+    emit8(as, opcode & 0xff);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void patchHere(Assembler* as, int at){
+    patch32(as, at, as->count - (at + 4));
+}
+
+static void emitJumpTo(Assembler* as, uint16_t opcode, int target){
+    writeFixup(&as->jumps, emitJumpPlaceholder(as, opcode), target);
+}
+
+// Leaves the JIT code so the interpreter resumes at the given bytecode offset.
+static void emitBail(Assembler* as, uint16_t opcode, int offset){
+    writeFixup(&as->bails, emitJumpPlaceholder(as, opcode), offset);
+}
+
+static void emitBailIfFalse(Assembler* as, int offset){
+    emit8(as, 0x84);
+    emit8(as, 0xC0);
+    emitBail(as, JUMP_EQUAL, offset);
+}
+
+static void emitGuardNumber(Assembler* as, int base, int32_t disp, int offset){
+    emitCompareType(as, base, disp, VAL_NUMBER);
+    emitBail(as, JUMP_NOT_EQUAL, offset);
+}
+
+// Loads the result of `ucomisd` as a boolean into rax.
+static void emitSetAbove(Assembler* as){
+    emit8(as, 0x0F);
+    emit8(as, 0x97);
+    emit8(as, 0xC0);
+    emit8(as, 0x0F);
+    emit8(as, 0xB6);
+    emit8(as, 0xC0);
+}
+
+static void emitPushResult(Assembler* as, ValueType type, bool inRax){
+    emitStoreImmediate(as, false, STACK_TOP, 0, type);
+    if (inRax) emitMemory(as, 0, true, OP_MOV_STORE, RAX, STACK_TOP, PAYLOAD);
+    else emitStoreDouble(as, XMM0, STACK_TOP, PAYLOAD);
+    emitAdjustStack(as, 1);
+}
+
+/**************************************/
+
+/*********    Translation     *********/
+
+static void registerAddress(uint8_t operand, int* base, int32_t* disp){
+    if (operand & REGISTER_CONSTANT) {
+        *base = CONSTANTS;
+        *disp = (operand & REGISTER_MAX) * VALUE_SIZE;
+    }
+    else {
+        *base = SLOTS;
+        *disp = operand * VALUE_SIZE;
+    }
+}
+
+static void stackGuards(Assembler* as, int offset){
+    emitGuardNumber(as, STACK_TOP, -2 * VALUE_SIZE, offset);
+    emitGuardNumber(as, STACK_TOP, -VALUE_SIZE, offset);
+}
+
+static void stackArithmetic(Assembler* as, uint16_t sseOp){
+    emitLoadDouble(as, XMM0, STACK_TOP, -2 * VALUE_SIZE + PAYLOAD);
+    emitMemory(as, 0xF2, false, sseOp, XMM0, STACK_TOP, -VALUE_SIZE + PAYLOAD);
+    emitStoreDouble(as, XMM0, STACK_TOP, -2 * VALUE_SIZE + PAYLOAD);
+    emitAdjustStack(as, -1);
+}
+
+// `greater` computes a > b; otherwise a < b, as b > a so NaN compares false.
+static void stackComparison(Assembler* as, bool greater){
+    int a = -2 * VALUE_SIZE + PAYLOAD;
+    int b = -VALUE_SIZE + PAYLOAD;
+    emitLoadDouble(as, XMM0, STACK_TOP, greater ? a : b);
+    emitMemory(as, 0x66, false, OP_UCOMI_SD, XMM0, STACK_TOP, greater ? b : a);
+    emitSetAbove(as);
+    emitStoreImmediate(as, false, STACK_TOP, -2 * VALUE_SIZE, VAL_BOOL);
+    emitMemory(as, 0, true, OP_MOV_STORE, RAX, STACK_TOP, a);
+    emitAdjustStack(as, -1);
+}
+
+static void registerGuards(Assembler* as, uint8_t left, uint8_t right, int offset){
+    int base;
+    int32_t disp;
+    registerAddress(left, &base, &disp);
+    emitGuardNumber(as, base, disp, offset);
+    registerAddress(right, &base, &disp);
+    emitGuardNumber(as, base, disp, offset);
+}
+
+static void registerArithmetic(Assembler* as, uint16_t sseOp, uint8_t left, uint8_t right){
+    int base;
+    int32_t disp;
+    registerAddress(left, &base, &disp);
+    emitLoadDouble(as, XMM0, base, disp + PAYLOAD);
+    registerAddress(right, &base, &disp);
+    emitMemory(as, 0xF2, false, sseOp, XMM0, base, disp + PAYLOAD);
+}
+
+static void registerComparison(Assembler* as, bool greater, uint8_t left, uint8_t right, int offset){
+    int base;
+    int32_t disp;
+    registerGuards(as, left, right, offset);
+    registerAddress(greater ? left : right, &base, &disp);
+    emitLoadDouble(as, XMM0, base, disp + PAYLOAD);
+    registerAddress(greater ? right : left, &base, &disp);
+    emitMemory(as, 0x66, false, OP_UCOMI_SD, XMM0, base, disp + PAYLOAD);
+    emitSetAbove(as);
+    emitPushResult(as, VAL_BOOL, true);
+}
+
+static uint16_t sseOpFor(uint8_t instruction){
+    switch (instruction) {
+        case OP_ADD: case OP_ADD_RK: case OP_ADD_RK_SET:
+        case OP_ADD_UNCHECKED: return OP_ADD_SD;
+        case OP_SUBTRACT: case OP_SUBTRACT_RK: case OP_SUBTRACT_RK_SET:
+        case OP_SUBTRACT_UNCHECKED: return OP_SUB_SD;
+        case OP_MULTIPLY: case OP_MULTIPLY_RK: case OP_MULTIPLY_RK_SET:
+        case OP_MULTIPLY_UNCHECKED: return OP_MUL_SD;
+        default: return OP_DIV_SD;
+    }
+}
+
+static void callWithName(Assembler* as, void* helper, int constant){
+    ObjString* name = AS_STRING(as->chunk->constants.values[constant]);
+    emitMoveImmediate(as, RSI, (uint64_t) (uintptr_t) name);
+    emitCall(as, helper);
+}
+
+// Returns the offset of the next instruction, or -1 if this one can't be compiled.
+static int translate(Assembler* as, int offset){
+    uint8_t* code = as->chunk->code;
+    uint8_t instruction = genericOpcode(code[offset]);
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitCopyValue(as, CONSTANTS, code[offset + 1] * VALUE_SIZE, STACK_TOP, 0);
+            emitAdjustStack(as, 1);
+            return offset + 2;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitStoreImmediate(as, false, STACK_TOP, 0, instruction == OP_NIL ? VAL_NIL : VAL_BOOL);
+            emitStoreImmediate(as, true, STACK_TOP, PAYLOAD, instruction == OP_TRUE);
+            emitAdjustStack(as, 1);
+            return offset + 1;
+        case OP_POP:
+            emitAdjustStack(as, -1);
+            return offset + 1;
+        case OP_GET_LOCAL:
+            emitCopyValue(as, SLOTS, code[offset + 1] * VALUE_SIZE, STACK_TOP, 0);
+            emitAdjustStack(as, 1);
+            return offset + 2;
+        case OP_SET_LOCAL:
+            emitCopyValue(as, STACK_TOP, -VALUE_SIZE, SLOTS, code[offset + 1] * VALUE_SIZE);
+            return offset + 2;
+        case OP_DEFINE_GLOBAL:
+            callWithName(as, defineGlobalHelper, code[offset + 1]);
+            return offset + 2;
+        case OP_GET_GLOBAL:
+            callWithName(as, getGlobalHelper, code[offset + 1]);
+            emitBailIfFalse(as, offset);
+            return offset + 2;
+        case OP_SET_GLOBAL:
+            callWithName(as, setGlobalHelper, code[offset + 1]);
+            emitBailIfFalse(as, offset);
+            return offset + 2;
+
+        case OP_ADD: {
+            emitCompareType(as, STACK_TOP, -2 * VALUE_SIZE, VAL_NUMBER);
+            int slowLeft = emitJumpPlaceholder(as, JUMP_NOT_EQUAL);
+            emitCompareType(as, STACK_TOP, -VALUE_SIZE, VAL_NUMBER);
+            int slowRight = emitJumpPlaceholder(as, JUMP_NOT_EQUAL);
+            stackArithmetic(as, OP_ADD_SD);
+            int done = emitJumpPlaceholder(as, JUMP);
+            patchHere(as, slowLeft);
+            patchHere(as, slowRight);
+            emitCall(as, addHelper);
+            emitBailIfFalse(as, offset);
+            patchHere(as, done);
+            return offset + 1;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            stackGuards(as, offset);
+            stackArithmetic(as, sseOpFor(instruction));
+            return offset + 1;
+        case OP_NEGATE:
+            emitGuardNumber(as, STACK_TOP, -VALUE_SIZE, offset);
+            emitMoveImmediate(as, RAX, 0x8000000000000000ull);
+            emitMemory(as, 0, true, OP_XOR_STORE, RAX, STACK_TOP, -VALUE_SIZE + PAYLOAD);
+            return offset + 1;
+        case OP_GREATER:
+        case OP_LESS:
+            stackGuards(as, offset);
+            stackComparison(as, instruction == OP_GREATER);
+            return offset + 1;
+
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+            stackArithmetic(as, sseOpFor(instruction));
+            return offset + 1;
+        case OP_GREATER_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+            stackComparison(as, instruction == OP_GREATER_UNCHECKED);
+            return offset + 1;
+        case OP_NEGATE_UNCHECKED:
+            emitMoveImmediate(as, RAX, 0x8000000000000000ull);
+            emitMemory(as, 0, true, OP_XOR_STORE, RAX, STACK_TOP, -VALUE_SIZE + PAYLOAD);
+            return offset + 1;
+        case OP_EQUAL:
+            emitCall(as, equalHelper);
+            return offset + 1;
+        case OP_NOT:
+            emitCall(as, notHelper);
+            return offset + 1;
+        case OP_PRINT:
+            emitCall(as, printHelper);
+            return offset + 1;
+        case OP_CALL:
+            emitMoveImmediate(as, RSI, code[offset + 1]);
+            emitMoveImmediate(as, RDX, (uint64_t) (uintptr_t) (code + offset + 2));
+            emitCall(as, callHelper);
+            // cmp eax, CALL_FAILED
+            emit8(as, 0x83);
+            emit8(as, 0xF8);
+            emit8(as, CALL_FAILED);
+            emitBail(as, JUMP_EQUAL, JIT_RUNTIME_ERROR);
+            emit8(as, 0x83);
+            emit8(as, 0xF8);
+            emit8(as, CALL_SWITCHED);
+            emitBail(as, JUMP_EQUAL, JIT_SWITCHED);
+            return offset + 2;
+        case OP_RETURN:
+            emitCall(as, returnHelper);
+            emitBailIfFalse(as, offset);
+            emitBail(as, JUMP, JIT_SWITCHED);
+            return offset + 1;
+
+        case OP_JUMP:
+        case OP_LOOP: {
+            int jump = (code[offset + 1] << 8) | code[offset + 2];
+            emitJumpTo(as, JUMP, offset + 3 + (instruction == OP_LOOP ? -jump : jump));
+            return offset + 3;
+        }
+        case OP_JUMP_IF_FALSE: {
+            int target = offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+            // Booleans are tested inline, everything else goes through isFalsey().
+            emitCompareType(as, STACK_TOP, -VALUE_SIZE, VAL_BOOL);
+            int slow = emitJumpPlaceholder(as, JUMP_NOT_EQUAL);
+            emitMemory(as, 0, false, 0x80, 7, STACK_TOP, -VALUE_SIZE + PAYLOAD);
+            emit8(as, 0);
+            emitJumpTo(as, JUMP_EQUAL, target);
+            int done = emitJumpPlaceholder(as, JUMP);
+            patchHere(as, slow);
+            emitPointerArgument(as, RSI, STACK_TOP, -VALUE_SIZE);
+            emitCall(as, falseyHelper);
+            emit8(as, 0x84);
+            emit8(as, 0xC0);
+            emitJumpTo(as, JUMP_NOT_EQUAL, target);
+            patchHere(as, done);
+            return offset + 3;
+        }
+        case OP_ADD_RK: {
+            uint8_t left = code[offset + 1];
+            uint8_t right = code[offset + 2];
+            int base;
+            int32_t disp;
+            registerAddress(left, &base, &disp);
+            emitCompareType(as, base, disp, VAL_NUMBER);
+            int slowLeft = emitJumpPlaceholder(as, JUMP_NOT_EQUAL);
+            registerAddress(right, &base, &disp);
+            emitCompareType(as, base, disp, VAL_NUMBER);
+            int slowRight = emitJumpPlaceholder(as, JUMP_NOT_EQUAL);
+            registerArithmetic(as, OP_ADD_SD, left, right);
+            emitPushResult(as, VAL_NUMBER, false);
+            int done = emitJumpPlaceholder(as, JUMP);
+            patchHere(as, slowLeft);
+            patchHere(as, slowRight);
+            registerAddress(left, &base, &disp);
+            emitPointerArgument(as, RSI, base, disp);
+            registerAddress(right, &base, &disp);
+            emitPointerArgument(as, RDX, base, disp);
+            emitCall(as, addRegistersHelper);
+            emitBailIfFalse(as, offset);
+            patchHere(as, done);
+            return offset + 3;
+        }
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            registerGuards(as, code[offset + 1], code[offset + 2], offset);
+            registerArithmetic(as, sseOpFor(instruction), code[offset + 1], code[offset + 2]);
+            emitPushResult(as, VAL_NUMBER, false);
+            return offset + 3;
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+            registerComparison(as, instruction == OP_GREATER_RK, code[offset + 1], code[offset + 2], offset);
+            return offset + 3;
+        case OP_EQUAL_RK: {
+            int base;
+            int32_t disp;
+            registerAddress(code[offset + 1], &base, &disp);
+            emitPointerArgument(as, RSI, base, disp);
+            registerAddress(code[offset + 2], &base, &disp);
+            emitPointerArgument(as, RDX, base, disp);
+            emitCall(as, equalRegistersHelper);
+            return offset + 3;
+        }
+        case OP_ADD_RK_SET:
+        case OP_SUBTRACT_RK_SET:
+        case OP_MULTIPLY_RK_SET:
+        case OP_DIVIDE_RK_SET: {
+            // String concatenation into a slot is left to the interpreter.
+            int slot = code[offset + 1] * VALUE_SIZE;
+            registerGuards(as, code[offset + 2], code[offset + 3], offset);
+            registerArithmetic(as, sseOpFor(instruction), code[offset + 2], code[offset + 3]);
+            emitStoreImmediate(as, false, SLOTS, slot, VAL_NUMBER);
+            emitStoreDouble(as, XMM0, SLOTS, slot + PAYLOAD);
+            return offset + 4;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+// Called with the VM in rdi and the native address to start at in rsi.
+static void emitPrologue(Assembler* as){
+    static const int saved[] = {RBX, R12, R13, R14, R15};
+    for (int i = 0; i < 5; i++) {
+        emitRex(as, false, 0, saved[i]);
+        emit8(as, 0x50 + (saved[i] & 7));
+    }
+    // mov r13, rdi
+    emitRex(as, true, RDI, VM_BASE);
+    emit8(as, OP_MOV_STORE);
+    emit8(as, 0xC0 | ((RDI & 7) << 3) | (VM_BASE & 7));
+    emitMemory(as, 0, true, OP_MOV_LOAD, STACK_TOP, VM_BASE, STACK_TOP_FIELD);
+    emitMemory(as, 0, true, OP_MOV_LOAD, SLOTS, VM_BASE, SLOTS_FIELD);
+    emitMemory(as, 0, true, OP_MOV_LOAD, CONSTANTS, VM_BASE, CHUNK_FIELD);
+    emitMemory(as, 0, true, OP_MOV_LOAD, CONSTANTS, CONSTANTS, CONSTANTS_FIELD);
+    // jmp rsi
+    emit8(as, 0xFF);
+    emit8(as, 0xE0 | (RSI & 7));
+}
+
+static void emitEpilogue(Assembler* as){
+    static const int saved[] = {R15, R14, R13, R12, RBX};
+    emitMemory(as, 0, true, OP_MOV_STORE, STACK_TOP, VM_BASE, STACK_TOP_FIELD);
+    for (int i = 0; i < 5; i++) {
+        emitRex(as, false, 0, saved[i]);
+        emit8(as, 0x58 + (saved[i] & 7));
+    }
+    emit8(as, 0xC3);
+}
+
+static void finish(Assembler* as){
+    Chunk* chunk = as->chunk;
+
+    // Jumps into code that wasn't compiled resume in the interpreter instead.
+    for (int i = 0; i < as->jumps.count; i++) {
+        Fixup* jump = &as->jumps.fixups[i];
+        int start = jump->target < chunk->count ? as->instructionStart[jump->target] : -1;
+        if (start == -1) writeFixup(&as->bails, jump->at, jump->target);
+        else patch32(as, jump->at, start - (jump->at + 4));
+    }
+
+    for (int i = 0; i < as->bails.count; i++) {
+        patchHere(as, as->bails.fixups[i].at);
+        emit8(as, 0xB8);
+        emit32(as, (uint32_t) as->bails.fixups[i].target);
+        writeFixup(&as->exits, emitJumpPlaceholder(as, JUMP), 0);
+    }
+
+    for (int i = 0; i < as->exits.count; i++) patchHere(as, as->exits.fixups[i].at);
+    emitEpilogue(as);
+}
+
+static pthread_mutex_t perfMapLock = PTHREAD_MUTEX_INITIALIZER;
+// The process whose map has been started; a child after fork() starts its own.
+static pid_t perfMapOwner = 0;
+
+static void writePerfMap(JitCode* code, int length, const char* name){
+    pthread_mutex_lock(&perfMapLock);
+    pid_t pid = getpid();
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) pid);
+    // Truncated once, so a map left by an earlier process with this pid doesn't pile up.
+    FILE* file = fopen(path, perfMapOwner == pid ? "a" : "w");
+    if (file != NULL) {
+        perfMapOwner = pid;
+        fprintf(file, "%lx %x lox:%s\n", (unsigned long) (uintptr_t) code->code, length, name);
+        fclose(file);
+    }
+    pthread_mutex_unlock(&perfMapLock);
+}
+
+static JitCode* install(Assembler* as){
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t) as->count + page - 1) / page * page;
+
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+
+    JitCode* code = ALLOCATE(JitCode, 1);
+    code->code = memory;
+    code->size = size;
+    code->starts = as->instructionStart;
+    code->count = as->chunk->count;
+    return code;
+}
+
+/* Instructions that can't be compiled leave for the interpreter, which comes
+ * back at the next loop head or chunk switch. */
+JitCode* jitCompile(Chunk* chunk, const char* name){
+    Assembler as;
+    memset(&as, 0, sizeof(Assembler));
+    as.chunk = chunk;
+    as.instructionStart = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) as.instructionStart[i] = -1;
+
+    emitPrologue(&as);
+    for (int offset = 0; offset < chunk->count;) {
+        as.instructionStart[offset] = as.count;
+        int next = translate(&as, offset);
+        if (next == -1) {
+            emitBail(&as, JUMP, offset);
+            next = offset + instructionLength(chunk->code[offset]);
+        }
+        offset = next;
+    }
+    finish(&as);
+
+    JitCode* code = install(&as);
+    if (code != NULL) writePerfMap(code, as.count, name);
+    else FREE_ARRAY(int, as.instructionStart, chunk->count);
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(Fixup, as.jumps.fixups, as.jumps.capacity);
+    FREE_ARRAY(Fixup, as.bails.fixups, as.bails.capacity);
+    FREE_ARRAY(Fixup, as.exits.fixups, as.exits.capacity);
+    return code;
+}
+
+int jitExecute(VM* vm, JitCode* code, int offset){
+    if (offset >= code->count || code->starts[offset] == -1) return offset;
+    int (*entry)(VM*, uint8_t*) = (int (*)(VM*, uint8_t*)) code->code;
+    return entry(vm, code->code + code->starts[offset]);
+}
+
+void jitFree(JitCode* code){
+    munmap(code->code, code->size);
+    FREE_ARRAY(int, code->starts, code->count);
+    FREE(JitCode, code);
+}
+
+#else
+
+JitCode* jitCompile(Chunk* chunk, const char* name){
+    return NULL;
+}
+
+int jitExecute(VM* vm, JitCode* code, int offset){
+    return offset;
+}
+
+void jitFree(JitCode* code){
+}
+
+#endif
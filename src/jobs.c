@@ -0,0 +1,163 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jobs.h"
+#include "natives.h"
+
+typedef struct {
+    const char* path;
+    char* output;
+    size_t outputSize;
+    char* errors;
+    size_t errorsSize;
+    int exitCode;
+    bool done;
+} Job;
+
+typedef struct {
+    const VM* config;
+    bool stats;
+    InternTable strings;
+    Job* jobs;
+    int count;
+    atomic_int next;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} JobQueue;
+
+static char* readSource(const char* path, FILE* errOut){
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(errOut, "Could not open file %s.\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*) malloc(fileSize + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+        fprintf(errOut, "Could not read file %s.\n", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[fileSize] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+static void runJob(JobQueue* queue, Job* job){
+    FILE* out = open_memstream(&job->output, &job->outputSize);
+    FILE* errOut = open_memstream(&job->errors, &job->errorsSize);
+    if (out == NULL || errOut == NULL) {
+        fprintf(stderr, "Not enough memory to run %s.\n", job->path);
+        exit(74);
+    }
+
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        fprintf(stderr, "Not enough memory to run %s.\n", job->path);
+        exit(74);
+    }
+    initVM(vm);
+    vm->printCode = queue->config->printCode;
+    vm->registerCode = queue->config->registerCode;
+    vm->jit = queue->config->jit;
+    vm->traceExecution = queue->config->traceExecution;
+    vm->output.file = out;
+    vm->output.policy = queue->config->output.policy;
+    vm->errOut = errOut;
+    vm->traceOut = out;
+    vm->sharedStrings = &queue->strings;
+    // The jobs already keep the cores busy.
+    vm->workers.size = 0;
+    defineCoreNatives(vm);
+
+    char* source = readSource(job->path, errOut);
+    if (source == NULL) {
+        job->exitCode = 74;
+    }
+    else {
+        InterpretResult result = interpret(vm, source);
+        free(source);
+        job->exitCode = result == INTERPRET_COMPILE_ERROR ? 65
+                      : result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+    }
+
+    if (queue->stats) printVMStats(vm, errOut);
+    freeVM(vm);
+    free(vm);
+    fclose(out);
+    fclose(errOut);
+}
+
+static void* worker(void* arg){
+    JobQueue* queue = (JobQueue*) arg;
+    while (true) {
+        int index = atomic_fetch_add(&queue->next, 1);
+        if (index >= queue->count) return NULL;
+
+        Job* job = &queue->jobs[index];
+        runJob(queue, job);
+
+        pthread_mutex_lock(&queue->lock);
+        job->done = true;
+        pthread_cond_broadcast(&queue->finished);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+int runJobs(const VM* config, bool stats, const char** paths, int count, int threads){
+    JobQueue queue;
+    queue.config = config;
+    queue.stats = stats;
+    queue.jobs = calloc(count, sizeof(Job));
+    queue.count = count;
+    initInternTable(&queue.strings);
+    atomic_init(&queue.next, 0);
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.finished, NULL);
+    if (queue.jobs == NULL) {
+        fprintf(stderr, "Not enough memory for %d jobs.\n", count);
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) queue.jobs[i].path = paths[i];
+
+    if (threads > count) threads = count;
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    while (started < threads
+           && pthread_create(&workers[started], NULL, worker, &queue) == 0) {
+        started++;
+    }
+    // Without a single worker the scripts simply run on this thread.
+    if (started == 0) worker(&queue);
+
+    int exitCode = 0;
+    for (int i = 0; i < count; i++) {
+        Job* job = &queue.jobs[i];
+        pthread_mutex_lock(&queue.lock);
+        while (!job->done) pthread_cond_wait(&queue.finished, &queue.lock);
+        pthread_mutex_unlock(&queue.lock);
+
+        fwrite(job->output, 1, job->outputSize, stdout);
+        fflush(stdout);
+        fwrite(job->errors, 1, job->errorsSize, stderr);
+        free(job->output);
+        free(job->errors);
+        if (exitCode == 0) exitCode = job->exitCode;
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    free(queue.jobs);
+    freeInternTable(&queue.strings);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.finished);
+    return exitCode;
+}
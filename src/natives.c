@@ -0,0 +1,450 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "natives.h"
+#include "memory.h"
+#include "vector.h"
+#include "number.h"
+#include "object.h"
+#include "fiber.h"
+#include "io.h"
+
+static bool clockNative(VM* vm, int argCount, Value* args){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    args[-1] = NUMBER_VAL((double) now.tv_sec + now.tv_nsec / 1e9);
+    return true;
+}
+
+static bool lenNative(VM* vm, int argCount, Value* args){
+    if (IS_STRING(args[0])) args[-1] = NUMBER_VAL(AS_STRING(args[0])->length);
+    else if (IS_LIST(args[0])) args[-1] = NUMBER_VAL(listCount(AS_LIST(args[0])));
+    else if (IS_MAP(args[0])) args[-1] = NUMBER_VAL(AS_MAP(args[0])->count);
+    else {
+        runtimeError(vm, "len() expects a string, a list or a map.");
+        return false;
+    }
+    return true;
+}
+
+static bool appendNative(VM* vm, int argCount, Value* args){
+    if (!IS_LIST(args[0])) {
+        runtimeError(vm, "append() expects a list.");
+        return false;
+    }
+    listAppend(vm, AS_LIST(args[0]), args[1]);
+    args[-1] = args[0];
+    return true;
+}
+
+static bool parseNumberNative(VM* vm, int argCount, Value* args){
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "parseNumber() expects a string.");
+        return false;
+    }
+    ObjString* string = AS_STRING(args[0]);
+    double number;
+    args[-1] = parseNumber(string->chars, string->length, &number) ? NUMBER_VAL(number) : NIL_VAL;
+    return true;
+}
+
+/*********        Maps        *********/
+
+// Keeps the table's capacity, a power of two, within an int.
+#define MAP_CAPACITY_MAX (1 << 28)
+
+static bool mapNative(VM* vm, int argCount, Value* args){
+    if (argCount > 1) {
+        runtimeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+        return false;
+    }
+    double capacity = 0;
+    if (argCount == 1) {
+        capacity = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+        if (!(capacity >= 0 && capacity <= MAP_CAPACITY_MAX)) {
+            runtimeError(vm, "map() expects a capacity between 0 and %d.", MAP_CAPACITY_MAX);
+            return false;
+        }
+    }
+    ObjMap* map = newMap(vm);
+    tableReserve(&map->table, (int) capacity);
+    args[-1] = OBJ_VAL(map);
+    return true;
+}
+
+static bool hasNative(VM* vm, int argCount, Value* args){
+    if (!IS_MAP(args[0])) {
+        runtimeError(vm, "has() expects a map.");
+        return false;
+    }
+    Value value;
+    args[-1] = BOOL_VAL(tableGetValue(&AS_MAP(args[0])->table, args[1], &value));
+    return true;
+}
+
+// Returns whether the key was there.
+static bool removeNative(VM* vm, int argCount, Value* args){
+    if (!IS_MAP(args[0])) {
+        runtimeError(vm, "remove() expects a map.");
+        return false;
+    }
+    args[-1] = BOOL_VAL(mapDelete(AS_MAP(args[0]), args[1]));
+    return true;
+}
+
+// The keys or the values in table order, which is the same for both.
+static bool mapEntries(VM* vm, Value* args, const char* name, bool keys){
+    if (!IS_MAP(args[0])) {
+        runtimeError(vm, "%s() expects a map.", name);
+        return false;
+    }
+    Table* table = &AS_MAP(args[0])->table;
+    ObjList* list = newList(vm);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (!IS_NIL(entry->key)) listAppend(vm, list, keys ? entry->key : entry->value);
+    }
+    args[-1] = OBJ_VAL(list);
+    return true;
+}
+
+static bool keysNative(VM* vm, int argCount, Value* args){
+    return mapEntries(vm, args, "keys", true);
+}
+
+static bool valuesNative(VM* vm, int argCount, Value* args){
+    return mapEntries(vm, args, "values", false);
+}
+
+/**************************************/
+
+/*********    Bulk numbers    *********/
+
+/* Packed lists go straight to the kernels in vector.c. A list that was
+ * unpacked but holds only numbers again is copied into `scratch` first;
+ * anything else is an error. */
+static bool listNumbers(VM* vm, Value value, const char* name, NumberArray* scratch,
+                        double** numbers, int* count){
+    initNumberArray(scratch);
+    if (!IS_LIST(value)) {
+        runtimeError(vm, "%s() expects a list of numbers.", name);
+        return false;
+    }
+    ObjList* list = AS_LIST(value);
+    if (list->packed) {
+        *numbers = list->numbers.values;
+        *count = list->numbers.count;
+        return true;
+    }
+    for (int i = 0; i < list->items.count; i++) {
+        if (!IS_NUMBER(list->items.values[i])) {
+            freeNumberArray(scratch);
+            runtimeError(vm, "%s() expects a list of numbers.", name);
+            return false;
+        }
+        writeNumberArray(scratch, AS_NUMBER(list->items.values[i]));
+    }
+    *numbers = scratch->values;
+    *count = scratch->count;
+    return true;
+}
+
+/* Lists of at least PARALLEL_THRESHOLD numbers are split into tasks of
+ * BULK_CHUNK numbers for the VM's worker pool. The split doesn't depend on
+ * the number of threads, and partial results are combined in order, so a
+ * result comes out the same however many cores computed it. */
+
+#define BULK_CHUNK (1 << 15)
+#define PARALLEL_THRESHOLD (1 << 16)
+
+typedef enum {
+    BULK_SUM,
+    BULK_MIN,
+    BULK_MAX,
+    BULK_DOT,
+    BULK_ADD,
+    BULK_SCALE,
+} BulkKind;
+
+// Everything a task may touch: no VM, no objects, just the arrays.
+typedef struct {
+    BulkKind kind;
+    const double* a;
+    const double* b;
+    double factor;
+    int count;
+    double* result;
+    double* partials;
+} BulkJob;
+
+static void runBulkTask(void* context, int task){
+    BulkJob* job = (BulkJob*) context;
+    int start = task * BULK_CHUNK;
+    int count = job->count - start < BULK_CHUNK ? job->count - start : BULK_CHUNK;
+    const double* a = job->a + start;
+    switch (job->kind) {
+        case BULK_SUM:   job->partials[task] = sumNumbers(a, count); break;
+        case BULK_MIN:   job->partials[task] = minNumbers(a, count); break;
+        case BULK_MAX:   job->partials[task] = maxNumbers(a, count); break;
+        case BULK_DOT:   job->partials[task] = dotNumbers(a, job->b + start, count); break;
+        case BULK_ADD:   addNumbers(job->result + start, a, job->b + start, count); break;
+        case BULK_SCALE: scaleNumbers(job->result + start, a, job->factor, count); break;
+    }
+}
+
+// Runs `job` over all its numbers and returns the reduction, if it is one.
+static double runBulk(VM* vm, BulkJob* job){
+    if (job->count < PARALLEL_THRESHOLD) {
+        job->partials = NULL;
+        switch (job->kind) {
+            case BULK_SUM:   return sumNumbers(job->a, job->count);
+            case BULK_MIN:   return minNumbers(job->a, job->count);
+            case BULK_MAX:   return maxNumbers(job->a, job->count);
+            case BULK_DOT:   return dotNumbers(job->a, job->b, job->count);
+            case BULK_ADD:   addNumbers(job->result, job->a, job->b, job->count); return 0;
+            case BULK_SCALE: scaleNumbers(job->result, job->a, job->factor, job->count); return 0;
+        }
+    }
+
+    int tasks = (job->count + BULK_CHUNK - 1) / BULK_CHUNK;
+    double* partials = ALLOCATE(double, tasks);
+    job->partials = partials;
+    runTasks(&vm->workers, tasks, runBulkTask, job);
+
+    double result = 0;
+    switch (job->kind) {
+        case BULK_SUM:
+        case BULK_DOT: result = sumNumbers(partials, tasks); break;
+        case BULK_MIN: result = minNumbers(partials, tasks); break;
+        case BULK_MAX: result = maxNumbers(partials, tasks); break;
+        default: break;
+    }
+    FREE_ARRAY(double, partials, tasks);
+    return result;
+}
+
+// A new packed list of `count` uninitialized numbers.
+static ObjList* newNumberList(VM* vm, int count){
+    ObjList* list = newList(vm);
+    list->numbers.values = ALLOCATE(double, count);
+    list->numbers.capacity = count;
+    list->numbers.count = count;
+    return list;
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args){
+    NumberArray scratch;
+    double* numbers;
+    int count;
+    if (!listNumbers(vm, args[0], "sum", &scratch, &numbers, &count)) return false;
+    BulkJob job = {.kind = BULK_SUM, .a = numbers, .count = count};
+    args[-1] = NUMBER_VAL(runBulk(vm, &job));
+    freeNumberArray(&scratch);
+    return true;
+}
+
+static bool extremeNative(VM* vm, Value* args, const char* name, BulkKind kind){
+    NumberArray scratch;
+    double* numbers;
+    int count;
+    if (!listNumbers(vm, args[0], name, &scratch, &numbers, &count)) return false;
+    BulkJob job = {.kind = kind, .a = numbers, .count = count};
+    args[-1] = count == 0 ? NIL_VAL : NUMBER_VAL(runBulk(vm, &job));
+    freeNumberArray(&scratch);
+    return true;
+}
+
+static bool minNative(VM* vm, int argCount, Value* args){
+    return extremeNative(vm, args, "min", BULK_MIN);
+}
+
+static bool maxNative(VM* vm, int argCount, Value* args){
+    return extremeNative(vm, args, "max", BULK_MAX);
+}
+
+static bool dotNative(VM* vm, int argCount, Value* args){
+    NumberArray aScratch, bScratch;
+    double *a, *b;
+    int aCount, bCount;
+    if (!listNumbers(vm, args[0], "dot", &aScratch, &a, &aCount)) return false;
+    if (!listNumbers(vm, args[1], "dot", &bScratch, &b, &bCount)) {
+        freeNumberArray(&aScratch);
+        return false;
+    }
+    bool sameLength = aCount == bCount;
+    if (sameLength) {
+        BulkJob job = {.kind = BULK_DOT, .a = a, .b = b, .count = aCount};
+        args[-1] = NUMBER_VAL(runBulk(vm, &job));
+    }
+    freeNumberArray(&aScratch);
+    freeNumberArray(&bScratch);
+    if (!sameLength) runtimeError(vm, "dot() expects lists of the same length.");
+    return sameLength;
+}
+
+static bool addNative(VM* vm, int argCount, Value* args){
+    NumberArray aScratch, bScratch;
+    double *a, *b;
+    int aCount, bCount;
+    if (!listNumbers(vm, args[0], "add", &aScratch, &a, &aCount)) return false;
+    if (!listNumbers(vm, args[1], "add", &bScratch, &b, &bCount)) {
+        freeNumberArray(&aScratch);
+        return false;
+    }
+    bool sameLength = aCount == bCount;
+    if (sameLength) {
+        ObjList* result = newNumberList(vm, aCount);
+        BulkJob job = {.kind = BULK_ADD, .a = a, .b = b, .count = aCount, .result = result->numbers.values};
+        runBulk(vm, &job);
+        args[-1] = OBJ_VAL(result);
+    }
+    freeNumberArray(&aScratch);
+    freeNumberArray(&bScratch);
+    if (!sameLength) runtimeError(vm, "add() expects lists of the same length.");
+    return sameLength;
+}
+
+static bool scaleNative(VM* vm, int argCount, Value* args){
+    if (!IS_NUMBER(args[1])) {
+        runtimeError(vm, "scale() expects a number to scale by.");
+        return false;
+    }
+    NumberArray scratch;
+    double* numbers;
+    int count;
+    if (!listNumbers(vm, args[0], "scale", &scratch, &numbers, &count)) return false;
+    ObjList* result = newNumberList(vm, count);
+    BulkJob job = {.kind = BULK_SCALE, .a = numbers, .factor = AS_NUMBER(args[1]), .count = count,
+                   .result = result->numbers.values};
+    runBulk(vm, &job);
+    args[-1] = OBJ_VAL(result);
+    freeNumberArray(&scratch);
+    return true;
+}
+
+static int compareStrings(const void* a, const void* b){
+    ObjString* left = AS_STRING(*(const Value*) a);
+    ObjString* right = AS_STRING(*(const Value*) b);
+    int length = left->length < right->length ? left->length : right->length;
+    int order = memcmp(left->chars, right->chars, length);
+    return order != 0 ? order : left->length - right->length;
+}
+
+// Sorts a list of numbers or a list of strings in place and returns it.
+static bool sortNative(VM* vm, int argCount, Value* args){
+    if (IS_LIST(args[0]) && !AS_LIST(args[0])->packed) {
+        ValueArray* items = &AS_LIST(args[0])->items;
+        bool strings = true;
+        for (int i = 0; i < items->count && strings; i++) strings = IS_STRING(items->values[i]);
+        if (strings) {
+            qsort(items->values, items->count, sizeof(Value), compareStrings);
+            args[-1] = args[0];
+            return true;
+        }
+    }
+
+    NumberArray scratch;
+    double* numbers;
+    int count;
+    if (!listNumbers(vm, args[0], "sort", &scratch, &numbers, &count)) return false;
+    // Packed lists sort in place, even in an image's (private) mapping.
+    sortNumbers(numbers, count);
+    ObjList* list = AS_LIST(args[0]);
+    if (!list->packed)
+        for (int i = 0; i < count; i++) list->items.values[i] = NUMBER_VAL(numbers[i]);
+    freeNumberArray(&scratch);
+    args[-1] = args[0];
+    return true;
+}
+
+/**************************************/
+
+/*********       Fibers       *********/
+
+// A fiber's function gets the value it's spawned with or the one from the
+// resume() that starts it, if it takes one.
+static bool newFiberFrom(VM* vm, Value function, const char* name, ObjFiber** fiber){
+    if (!IS_FUNCTION(function) || AS_FUNCTION(function)->arity > 1) {
+        runtimeError(vm, "%s() expects a function taking at most one argument.", name);
+        return false;
+    }
+    *fiber = newFiber(vm, AS_FUNCTION(function));
+    return true;
+}
+
+static bool fiberNative(VM* vm, int argCount, Value* args){
+    ObjFiber* fiber;
+    if (!newFiberFrom(vm, args[0], "fiber", &fiber)) return false;
+    args[-1] = OBJ_VAL(fiber);
+    return true;
+}
+
+static bool spawnNative(VM* vm, int argCount, Value* args){
+    if (argCount < 1 || argCount > 2) {
+        runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+        return false;
+    }
+    ObjFiber* fiber;
+    if (!newFiberFrom(vm, args[0], "spawn", &fiber)) return false;
+    spawnFiber(vm, fiber, argCount == 2 ? args[1] : NIL_VAL);
+    args[-1] = OBJ_VAL(fiber);
+    return true;
+}
+
+static bool resumeNative(VM* vm, int argCount, Value* args){
+    if (argCount < 1 || argCount > 2) {
+        runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+        return false;
+    }
+    if (!IS_FIBER(args[0])) {
+        runtimeError(vm, "resume() expects a fiber.");
+        return false;
+    }
+    return resumeFiber(vm, AS_FIBER(args[0]), argCount == 2 ? args[1] : NIL_VAL, &args[-1]);
+}
+
+static bool yieldNative(VM* vm, int argCount, Value* args){
+    if (argCount > 1) {
+        runtimeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+        return false;
+    }
+    yieldFiber(vm, argCount == 1 ? args[0] : NIL_VAL, &args[-1]);
+    return true;
+}
+
+static bool isDoneNative(VM* vm, int argCount, Value* args){
+    if (!IS_FIBER(args[0])) {
+        runtimeError(vm, "isDone() expects a fiber.");
+        return false;
+    }
+    args[-1] = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+/**************************************/
+
+void defineCoreNatives(VM* vm){
+    defineNative(vm, "clock", clockNative, 0);
+    defineNative(vm, "len", lenNative, 1);
+    defineNative(vm, "append", appendNative, 2);
+    defineNative(vm, "parseNumber", parseNumberNative, 1);
+    defineNative(vm, "map", mapNative, -1);
+    defineNative(vm, "has", hasNative, 2);
+    defineNative(vm, "remove", removeNative, 2);
+    defineNative(vm, "keys", keysNative, 1);
+    defineNative(vm, "values", valuesNative, 1);
+    defineNative(vm, "sum", sumNative, 1);
+    defineNative(vm, "min", minNative, 1);
+    defineNative(vm, "max", maxNative, 1);
+    defineNative(vm, "dot", dotNative, 2);
+    defineNative(vm, "add", addNative, 2);
+    defineNative(vm, "scale", scaleNative, 2);
+    defineNative(vm, "sort", sortNative, 1);
+    defineNative(vm, "fiber", fiberNative, 1);
+    defineNative(vm, "spawn", spawnNative, -1);
+    defineNative(vm, "resume", resumeNative, -1)->switchesFiber = true;
+    defineNative(vm, "yield", yieldNative, -1)->switchesFiber = true;
+    defineNative(vm, "isDone", isDoneNative, 1);
+    defineIoNatives(vm);
+}
@@ -4,18 +4,274 @@
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
+#include "image.h"
+#include "timeline.h"
 
-#define ALLOCATE_OBJ(type, objectType) (type*) allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) (type*) allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjectType type){
+#ifdef DEBUG_STATS
+#define COUNT_INTERN(interned) ((interned) != NULL ? vm->internHits++ : vm->internMisses++)
+#else
+#define COUNT_INTERN(interned) ((void) 0)
+#endif
+
+static Obj* allocateObject(VM* vm, size_t size, ObjectType type){
     Obj* object = (Obj*) reallocate(NULL, 0, size);
     object->type = type;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
+static void freeObject(Obj* object){
+    switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            FREE(ObjBoundMethod, object);
+            break;
+        case OBJ_CLASS:
+            freeTable(&((ObjClass*) object)->methods);
+            FREE(ObjClass, object);
+            break;
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+            FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE(ObjFiber, object);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            freeChunk(&function->chunk);
+            FREE(ObjFunction, object);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
+            FREE(ObjInstance, object);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) object;
+            freeNumberArray(&list->numbers);
+            freeValueArray(&list->items);
+            FREE(ObjList, object);
+            break;
+        }
+        case OBJ_MAP:
+            freeTable(&((ObjMap*) object)->table);
+            FREE(ObjMap, object);
+            break;
+        case OBJ_NATIVE:
+            FREE(ObjNative, object);
+            break;
+        case OBJ_SHAPE:
+            freeTable(&((ObjShape*) object)->transitions);
+            FREE(ObjShape, object);
+            break;
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            FREE_ARRAY(char, string->chars, string->length + 1);
+            FREE(ObjString, object);
+            break;
+        }
+    }
+}
+
+void freeObjects(VM* vm){
+    TIMELINE_BEGIN("freeObjects");
+    Obj* object = vm->objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        freeObject(object);
+        object = next;
+    }
+    TIMELINE_END("freeObjects");
+}
+
+/* Tables booted from an image keep their entries in the mapping, so like
+ * a list's items they're copied out before they could be resized, and the
+ * copy isn't freed with the VM either. */
+static void ownEntries(VM* vm, Table* table){
+    if (!inImage(vm, table->entries)) return;
+    Entry* entries = ALLOCATE(Entry, table->capacity);
+    memcpy(entries, table->entries, sizeof(Entry) * table->capacity);
+    table->entries = entries;
+}
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjFunction* method){
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+static ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name){
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name){
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+    klass->name = name;
+    klass->superclass = NULL;
+    initTable(&klass->methods);
+    klass->initializer = NULL;
+    klass->shape = newShape(vm, NULL, NULL);
+    klass->fieldHint = 0;
+    return klass;
+}
+
+ObjFiber* newFiber(VM* vm, ObjFunction* function){
+    // The stacks are only made when it first runs.
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->function = function;
+    fiber->stack = NULL;
+    fiber->stackCapacity = 0;
+    fiber->stackTop = NULL;
+    fiber->frames = NULL;
+    fiber->frameCapacity = 0;
+    fiber->frameCount = 0;
+    fiber->caller = NULL;
+    fiber->next = NULL;
+    return fiber;
+}
+
+ObjFunction* newFunction(VM* vm){
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->name = NULL;
+    function->owner = NULL;
+    initChunk(&function->chunk);
+    return function;
+}
+
+ObjInstance* newInstance(VM* vm, ObjClass* klass){
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+    instance->klass = klass;
+    instance->shape = klass->shape;
+    instance->capacity = klass->fieldHint;
+    instance->fields = instance->capacity > 0 ? ALLOCATE(Value, instance->capacity) : NULL;
+    return instance;
+}
+
+int shapeField(ObjShape* shape, ObjString* name){
+    // Names are interned, and instances seldom have many fields.
+    for (; shape->name != NULL; shape = shape->parent)
+        if (shape->name == name) return shape->fieldCount - 1;
+    return -1;
+}
+
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name){
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) return (ObjShape*) AS_OBJ(child);
+
+    ObjShape* next = newShape(vm, shape, name);
+    ownEntries(vm, &shape->transitions);
+    tableSet(&shape->transitions, name, OBJ_VAL(next));
+    return next;
+}
+
+void reshapeInstance(VM* vm, ObjInstance* instance, ObjShape* shape){
+    if (shape->fieldCount > instance->capacity) {
+        int capacity = GROW_CAPACITY(instance->capacity);
+        if (inImage(vm, instance->fields)) {
+            Value* fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->fields, sizeof(Value) * instance->shape->fieldCount);
+            instance->fields = fields;
+        }
+        else instance->fields = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+        instance->capacity = capacity;
+    }
+    if (shape->fieldCount > instance->klass->fieldHint) instance->klass->fieldHint = shape->fieldCount;
+    instance->shape = shape;
+}
+
+ObjList* newList(VM* vm){
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    list->packed = true;
+    initNumberArray(&list->numbers);
+    initValueArray(&list->items);
+    return list;
+}
+
+/* Lists booted from an image keep their arrays in the mapping, which can't
+ * be grown or freed, so they're copied out before the first change of size.
+ * The copy isn't freed with the VM, as the list itself isn't on vm->objects. */
+static void ownItems(VM* vm, ObjList* list){
+    if (list->packed && inImage(vm, list->numbers.values)) {
+        double* numbers = ALLOCATE(double, list->numbers.count);
+        memcpy(numbers, list->numbers.values, sizeof(double) * list->numbers.count);
+        list->numbers.values = numbers;
+    }
+    else if (!list->packed && inImage(vm, list->items.values)) {
+        Value* values = ALLOCATE(Value, list->items.count);
+        memcpy(values, list->items.values, sizeof(Value) * list->items.count);
+        list->items.values = values;
+    }
+}
+
+static void unpackList(VM* vm, ObjList* list){
+    ValueArray items;
+    initValueArray(&items);
+    for (int i = 0; i < list->numbers.count; i++)
+        writeValueArray(&items, NUMBER_VAL(list->numbers.values[i]));
+    if (!inImage(vm, list->numbers.values)) freeNumberArray(&list->numbers);
+    initNumberArray(&list->numbers);
+    list->items = items;
+    list->packed = false;
+}
+
+void listAppend(VM* vm, ObjList* list, Value value){
+    if (list->packed && !IS_NUMBER(value)) unpackList(vm, list);
+    ownItems(vm, list);
+    // The arrays double as they fill, so appends are amortized O(1).
+    if (list->packed) writeNumberArray(&list->numbers, AS_NUMBER(value));
+    else writeValueArray(&list->items, value);
+}
+
+void listSet(VM* vm, ObjList* list, int index, Value value){
+    if (list->packed && IS_NUMBER(value)) {
+        list->numbers.values[index] = AS_NUMBER(value);
+        return;
+    }
+    if (list->packed) unpackList(vm, list);
+    list->items.values[index] = value;
+}
+
+ObjMap* newMap(VM* vm){
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    initTable(&map->table);
+    map->count = 0;
+    return map;
+}
+
+void mapSet(VM* vm, ObjMap* map, Value key, Value value){
+    ownEntries(vm, &map->table);
+    if (tableSetValue(&map->table, key, value)) map->count++;
+}
+
+bool mapDelete(ObjMap* map, Value key){
+    if (!tableDeleteValue(&map->table, key)) return false;
+    map->count--;
+    return true;
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name){
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    native->switchesFiber = false;
+    return native;
+}
+
 static uint32_t hashString(const char* key, int length){
     uint32_t hash = 2166136261u;
     for (int i=0; i<length; i++) {
@@ -25,43 +281,161 @@ static uint32_t hashString(const char* key, int length){
     return hash;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash){
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* findInterned(VM* vm, const char* chars, int length, uint32_t hash){
+    if (vm->sharedStrings != NULL)
+        return internFind(vm->sharedStrings, chars, length, hash);
+    return tableFindString(&vm->strings, chars, length, hash);
+}
+
+/* Strings interned in a shared table belong to the table, not to any one
+ * VM, so they're kept off vm->objects. Another thread may intern an equal
+ * string between the lookup and internAdd(); then its copy wins. */
+static ObjString* allocateSharedString(InternTable* table, char* chars, int length, uint32_t hash){
+    ObjString* string = (ObjString*) reallocate(NULL, 0, sizeof(ObjString));
+    string->Obj.type = OBJ_STRING;
+    string->Obj.next = NULL;
+    string->length = length;
+    string->chars = chars;
+    string->hash = hash;
+
+    ObjString* interned = internAdd(table, string);
+    if (interned != string) {
+        FREE_ARRAY(char, chars, length + 1);
+        FREE(ObjString, string);
+    }
+    return interned;
+}
+
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash){
+    if (vm->sharedStrings != NULL)
+        return allocateSharedString(vm->sharedStrings, chars, length, hash);
+
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
     return string;
 }
 
-ObjString* takeString(char* chars, int length){
+ObjString* takeString(VM* vm, char* chars, int length){
+    TIMELINE_BEGIN("takeString");
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
+    COUNT_INTERN(interned);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
+        TIMELINE_END("takeString");
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    ObjString* string = allocateString(vm, chars, length, hash);
+    TIMELINE_END("takeString");
+    return string;
 }
 
-ObjString* copyString(const char* chars, int length){
+ObjString* copyString(VM* vm, const char* chars, int length){
+    TIMELINE_BEGIN("copyString");
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    ObjString* interned = findInterned(vm, chars, length, hash);
+    COUNT_INTERN(interned);
+    if (interned != NULL) {
+        TIMELINE_END("copyString");
+        return interned;
+    }
 
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
-    heapChars[length + 1] = '\0';
-    return allocateString(heapChars, length, hash);
+    heapChars[length] = '\0';
+    ObjString* string = allocateString(vm, heapChars, length, hash);
+    TIMELINE_END("copyString");
+    return string;
+}
+
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b){
+    int length = a->length + b->length;
+    char* chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+
+    return takeString(vm, chars, length);
+}
+
+static void printObjectIn(FILE* out, Value value, Printing* outer);
+
+static void printNested(FILE* out, Value value, Printing* outer){
+    if (IS_OBJ(value)) printObjectIn(out, value, outer);
+    else fprintValue(out, value);
 }
 
-void printObject(Value value){
+static void printObjectIn(FILE* out, Value value, Printing* outer){
     switch (OBJ_TYPE(value)) {
+        case OBJ_BOUND_METHOD:
+            fprintf(out, "<fn %s>", AS_BOUND_METHOD(value)->method->name->chars);
+            break;
+        case OBJ_CLASS:
+            fprintf(out, "%s", AS_CLASS(value)->name->chars);
+            break;
+        case OBJ_FUNCTION:
+            fprintf(out, "<fn %s>", AS_FUNCTION(value)->name->chars);
+            break;
+        case OBJ_INSTANCE:
+            fprintf(out, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+            break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (isPrinting(outer, AS_OBJ(value))) {
+                fputs("[...]", out);
+                break;
+            }
+            Printing printing = {AS_OBJ(value), outer};
+            fputc('[', out);
+            for (int i = 0; i < listCount(list); i++) {
+                if (i > 0) fputs(", ", out);
+                printNested(out, listGet(list, i), &printing);
+            }
+            fputc(']', out);
+            break;
+        }
+        case OBJ_MAP: {
+            Table* table = &AS_MAP(value)->table;
+            if (isPrinting(outer, AS_OBJ(value))) {
+                fputs("{...}", out);
+                break;
+            }
+            Printing printing = {AS_OBJ(value), outer};
+            bool first = true;
+            fputc('{', out);
+            for (int i = 0; i < table->capacity; i++) {
+                Entry* entry = &table->entries[i];
+                if (IS_NIL(entry->key)) continue;
+                if (!first) fputs(", ", out);
+                first = false;
+                printNested(out, entry->key, &printing);
+                fputs(": ", out);
+                printNested(out, entry->value, &printing);
+            }
+            fputc('}', out);
+            break;
+        }
+        case OBJ_FIBER:
+            fprintf(out, "<fiber>");
+            break;
+        case OBJ_NATIVE:
+            fprintf(out, "<native fn %s>", AS_NATIVE(value)->name->chars);
+            break;
+        case OBJ_SHAPE:
+            fprintf(out, "<shape>");
+            break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fprintf(out, "%s", AS_CSTRING(value));
             break;
     }
-}
\ No newline at end of file
+}
+
+void printObject(FILE* out, Value value){
+    printObjectIn(out, value, NULL);
+}
@@ -0,0 +1,150 @@
+#include <unistd.h>
+#include <string.h>
+
+#include "output.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+
+void initOutput(Output* output, FILE* file){
+    output->file = file;
+    output->policy = isatty(fileno(file)) ? FLUSH_LINE : FLUSH_FULL;
+    output->buffer = NULL;
+    output->count = 0;
+    output->capacity = 0;
+}
+
+void freeOutput(Output* output){
+    flushOutput(output);
+    FREE_ARRAY(char, output->buffer, output->capacity);
+    output->buffer = NULL;
+    output->capacity = 0;
+}
+
+void flushOutput(Output* output){
+    if (output->count > 0) fwrite(output->buffer, 1, output->count, output->file);
+    output->count = 0;
+    fflush(output->file);
+}
+
+static void reserve(Output* output, size_t length){
+    if (output->capacity - output->count >= length) return;
+    if (output->policy != FLUSH_EXIT && output->count > 0) flushOutput(output);
+
+    size_t oldCapacity = output->capacity;
+    size_t capacity = oldCapacity < OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : oldCapacity;
+    while (capacity - output->count < length) capacity *= 2;
+    if (capacity != oldCapacity) {
+        output->buffer = GROW_ARRAY(char, output->buffer, oldCapacity, capacity);
+        output->capacity = capacity;
+    }
+}
+
+void writeOutput(Output* output, const char* bytes, size_t length){
+    reserve(output, length);
+    memcpy(output->buffer + output->count, bytes, length);
+    output->count += length;
+}
+
+static void writeString(Output* output, ObjString* string){
+    writeOutput(output, string->chars, string->length);
+}
+
+static void writeValue(Output* output, Value value, Printing* outer);
+
+static void writeObject(Output* output, Value value, Printing* outer){
+    switch (OBJ_TYPE(value)) {
+        case OBJ_BOUND_METHOD:
+            writeOutput(output, "<fn ", 4);
+            writeString(output, AS_BOUND_METHOD(value)->method->name);
+            writeOutput(output, ">", 1);
+            break;
+        case OBJ_CLASS:
+            writeString(output, AS_CLASS(value)->name);
+            break;
+        case OBJ_FUNCTION:
+            writeOutput(output, "<fn ", 4);
+            writeString(output, AS_FUNCTION(value)->name);
+            writeOutput(output, ">", 1);
+            break;
+        case OBJ_INSTANCE:
+            writeString(output, AS_INSTANCE(value)->klass->name);
+            writeOutput(output, " instance", 9);
+            break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (isPrinting(outer, AS_OBJ(value))) {
+                writeOutput(output, "[...]", 5);
+                break;
+            }
+            Printing printing = {AS_OBJ(value), outer};
+            writeOutput(output, "[", 1);
+            for (int i = 0; i < listCount(list); i++) {
+                if (i > 0) writeOutput(output, ", ", 2);
+                writeValue(output, listGet(list, i), &printing);
+            }
+            writeOutput(output, "]", 1);
+            break;
+        }
+        case OBJ_MAP: {
+            Table* table = &AS_MAP(value)->table;
+            if (isPrinting(outer, AS_OBJ(value))) {
+                writeOutput(output, "{...}", 5);
+                break;
+            }
+            Printing printing = {AS_OBJ(value), outer};
+            bool first = true;
+            writeOutput(output, "{", 1);
+            for (int i = 0; i < table->capacity; i++) {
+                Entry* entry = &table->entries[i];
+                if (IS_NIL(entry->key)) continue;
+                if (!first) writeOutput(output, ", ", 2);
+                first = false;
+                writeValue(output, entry->key, &printing);
+                writeOutput(output, ": ", 2);
+                writeValue(output, entry->value, &printing);
+            }
+            writeOutput(output, "}", 1);
+            break;
+        }
+        case OBJ_FIBER:
+            writeOutput(output, "<fiber>", 7);
+            break;
+        case OBJ_NATIVE:
+            writeOutput(output, "<native fn ", 11);
+            writeString(output, AS_NATIVE(value)->name);
+            writeOutput(output, ">", 1);
+            break;
+        case OBJ_SHAPE:
+            writeOutput(output, "<shape>", 7);
+            break;
+        case OBJ_STRING:
+            writeString(output, AS_STRING(value));
+            break;
+    }
+}
+
+static void writeValue(Output* output, Value value, Printing* outer){
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) writeOutput(output, "true", 4);
+            else writeOutput(output, "false", 5);
+            break;
+        case VAL_NIL:
+            writeOutput(output, "nil", 3);
+            break;
+        case VAL_NUMBER:
+            reserve(output, NUMBER_BUFFER_SIZE);
+            output->count += formatNumber(AS_NUMBER(value), output->buffer + output->count);
+            break;
+        case VAL_OBJ:
+            writeObject(output, value, outer);
+            break;
+    }
+}
+
+void printOutput(Output* output, Value value){
+    writeValue(output, value, NULL);
+    writeOutput(output, "\n", 1);
+    if (output->policy == FLUSH_LINE) flushOutput(output);
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "memory.h"
+
+int defaultPoolSize(){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 1 ? (int) cores - 1 : 0;
+}
+
+static void initSync(WorkerPool* pool){
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+}
+
+void initWorkerPool(WorkerPool* pool, int size){
+    pool->size = size;
+    pool->started = 0;
+    pool->threads = NULL;
+    pool->function = NULL;
+    pool->context = NULL;
+    pool->taskCount = 0;
+    atomic_init(&pool->nextTask, 0);
+    pool->running = 0;
+    pool->batch = 0;
+    pool->stopping = false;
+    initSync(pool);
+}
+
+static void workOn(WorkerPool* pool, PoolTask function, void* context, int taskCount){
+    int task;
+    while ((task = atomic_fetch_add(&pool->nextTask, 1)) < taskCount) function(context, task);
+}
+
+static void* worker(void* arg){
+    WorkerPool* pool = (WorkerPool*) arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->batch == seen && !pool->stopping) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping) break;
+        seen = pool->batch;
+        PoolTask function = pool->function;
+        void* context = pool->context;
+        int taskCount = pool->taskCount;
+        pthread_mutex_unlock(&pool->lock);
+
+        workOn(pool, function, context, taskCount);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void startWorkers(WorkerPool* pool){
+    pool->threads = ALLOCATE(pthread_t, pool->size);
+    while (pool->started < pool->size
+           && pthread_create(&pool->threads[pool->started], NULL, worker, pool) == 0) {
+        pool->started++;
+    }
+    // Whatever couldn't be started, the calling thread makes up for.
+    pool->size = pool->started;
+}
+
+void runTasks(WorkerPool* pool, int taskCount, PoolTask function, void* context){
+    if (pool->size > 0 && pool->threads == NULL) startWorkers(pool);
+    if (pool->started == 0 || taskCount == 1) {
+        for (int task = 0; task < taskCount; task++) function(context, task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->context = context;
+    pool->taskCount = taskCount;
+    atomic_store(&pool->nextTask, 0);
+    pool->running = pool->started;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    workOn(pool, function, context, taskCount);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freeWorkerPool(WorkerPool* pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->started; i++) pthread_join(pool->threads[i], NULL);
+
+    if (pool->threads != NULL) FREE_ARRAY(pthread_t, pool->threads, pool->size);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    pool->threads = NULL;
+    pool->started = 0;
+}
+
+void forgetWorkerPool(WorkerPool* pool){
+    // The parent's threads sit idle, so nobody held the lock when it forked.
+    if (pool->threads != NULL) FREE_ARRAY(pthread_t, pool->threads, pool->size);
+    pool->threads = NULL;
+    pool->started = 0;
+    // Fresh workers start out having seen batch 0.
+    pool->batch = 0;
+    pool->stopping = false;
+    initSync(pool);
+}
@@ -4,18 +4,10 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char* source){
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScanner(Scanner* scanner, const char* source){
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
 static bool isDigit(const char c){
@@ -28,68 +20,68 @@ static bool isAlpha(const char c){
             c == '_';
 }
 
-static bool isAtEnd(){
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner){
+    return *scanner->current == '\0';
 }
 
-static char advance(){
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner){
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static bool match(const char expected){
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, const char expected){
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
-static char peek(){
-    return *scanner.current;
+static char peek(Scanner* scanner){
+    return *scanner->current;
 }
 
-static char peekNext(){
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner){
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static Token makeToken(TokenType type){
+static Token makeToken(Scanner* scanner, TokenType type){
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int) (scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int) (scanner->current - scanner->start);
+    token.line = scanner->line;
 
     return token;
 }
 
-static Token errorToken(const char* msg) {
+static Token errorToken(Scanner* scanner, const char* msg) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = msg;
     token.length = (int) strlen(msg);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return  token;
 }
 
-static void skipWhitespace(){
+static void skipWhitespace(Scanner* scanner){
     while (true) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd())
-                        advance();
+                if (peekNext(scanner) == '/') {
+                    while (peek(scanner) != '\n' && !isAtEnd(scanner))
+                        advance(scanner);
                 }
                 else return;
                 break;
@@ -99,112 +91,141 @@ static void skipWhitespace(){
     }
 }
 
-static Token number(){
-    while (isDigit(peek()))
-        advance();
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
-        while (isDigit(peek()))
-            advance();
+static bool isHexDigit(const char c){
+    return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static Token number(Scanner* scanner){
+    if (scanner->start[0] == '0' && (peek(scanner) == 'x' || peek(scanner) == 'X')
+        && isHexDigit(peekNext(scanner))) {
+        advance(scanner);
+        while (isHexDigit(peek(scanner)))
+            advance(scanner);
+        return makeToken(scanner, TOKEN_NUMBER);
+    }
+    while (isDigit(peek(scanner)))
+        advance(scanner);
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
+        while (isDigit(peek(scanner)))
+            advance(scanner);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string(){
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner){
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
-    advance();
-    return makeToken(TOKEN_STRING);
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type){
-    if (scanner.current - scanner.start == start + length &&
-            memcmp(scanner.start + start, rest, length) == 0)
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type){
+    if (scanner->current - scanner->start == start + length &&
+            memcmp(scanner->start + start, rest, length) == 0)
         return type;
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType(){
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+static TokenType identifierType(Scanner* scanner){
+    switch (scanner->start[0]) {
+        case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+        case 'c':
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return checkKeyword(scanner, 2, 2, "se", TOKEN_CASE);
+                    case 'l': return checkKeyword(scanner, 2, 3, "ass", TOKEN_CLASS);
+                }
+            }
+            break;
+        case 'd': return checkKeyword(scanner, 1, 6, "efault", TOKEN_DEFAULT);
+        case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
+                }
+            }
+            break;
+        case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+        case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 's':
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'u': return checkKeyword(scanner, 2, 3, "per", TOKEN_SUPER);
+                    case 'w': return checkKeyword(scanner, 2, 4, "itch", TOKEN_SWITCH);
                 }
             }
             break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+                    case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier(){
-    while(isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner){
+    while(isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken(){
-    skipWhitespace();
-    scanner.start = scanner.current;
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+Token scanToken(Scanner* scanner){
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if (isDigit(c)) return number();
-    if (isAlpha(c)) return identifier();
+    if (isDigit(c)) return number(scanner);
+    if (isAlpha(c)) return identifier(scanner);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '*': return makeToken(TOKEN_STAR);
-        case '/': return makeToken(TOKEN_SLASH);
-
-        case '!': return makeToken(
-                match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ':': return makeToken(scanner, TOKEN_COLON);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+
+        case '!': return makeToken(scanner, 
+                match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG
                 );
-        case '=': return makeToken(
-                match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL
+        case '=': return makeToken(scanner, 
+                match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL
                 );
-        case '>': return makeToken(
-                match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER
+        case '>': return makeToken(scanner, 
+                match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER
                 );
-        case '<': return makeToken(
-                match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS
+        case '<': return makeToken(scanner, 
+                match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS
                 );
 
-        case '"': return string();
+        case '"': return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
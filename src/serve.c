@@ -0,0 +1,109 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "memory.h"
+#include "timeline.h"
+
+static int listenOn(const char* socketPath){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s.\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // Take over a socket left behind by an earlier run, but nothing else; bind() reports the rest.
+    struct stat status;
+    if (stat(socketPath, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(socketPath);
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1
+        || listen(fd, SOMAXCONN) == -1) {
+        perror(socketPath);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static char* readAll(int fd){
+    size_t capacity = 0;
+    size_t count = 0;
+    char* buffer = NULL;
+
+    while (true) {
+        if (capacity < count + 4096 + 1) {
+            size_t oldCapacity = capacity;
+            capacity = GROW_CAPACITY(oldCapacity) + 4096;
+            buffer = GROW_ARRAY(char, buffer, oldCapacity, capacity);
+        }
+        ssize_t bytesRead = read(fd, buffer + count, capacity - count - 1);
+        if (bytesRead < 0) {
+            FREE_ARRAY(char, buffer, capacity);
+            return NULL;
+        }
+        if (bytesRead == 0) break;
+        count += (size_t) bytesRead;
+    }
+    buffer[count] = '\0';
+    return buffer;
+}
+
+static void runConnection(VM* vm, int connection, int64_t forked){
+    vm->startupClock = forked;
+    forgetWorkerPool(&vm->workers);
+    forgetIoLoop(&vm->io);
+    char* source = readAll(connection);
+    if (source == NULL) {
+        perror("read");
+        _exit(74);
+    }
+
+    dup2(connection, STDOUT_FILENO);
+    close(connection);
+    vm->output.file = stdout;
+    vm->errOut = stdout;
+
+    InterpretResult result = interpret(vm, source);
+    flushOutput(&vm->output);
+    _exit(result == INTERPRET_COMPILE_ERROR ? 65 : result == INTERPRET_RUNTIME_ERROR ? 70 : 0);
+}
+
+void serveForks(VM* vm, const char* socketPath){
+    int listener = listenOn(socketPath);
+    if (listener == -1) return;
+
+    // Children are never waited for.
+    signal(SIGCHLD, SIG_IGN);
+    fprintf(stderr, "Serving on %s.\n", socketPath);
+
+    while (true) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection == -1) continue;
+
+        // Anything buffered would otherwise be written again by each child.
+        flushOutput(&vm->output);
+        fflush(stdout);
+        fflush(vm->traceOut);
+        int64_t forked = timelineClock();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            runConnection(vm, connection, forked);
+        }
+        if (pid == -1) perror("fork");
+        close(connection);
+    }
+}
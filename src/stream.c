@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "compiler.h"
+#include "memory.h"
+#include "scanner.h"
+
+#define STREAM_BLOCK 65536
+
+// The unconsumed part of the input is buffer[start..count), NUL-terminated.
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t start;
+    size_t count;
+    size_t capacity;
+    bool eof;
+    bool failed;
+    // Line the unconsumed input starts on.
+    int line;
+} Window;
+
+static void readMore(VM* vm, Window* window){
+    // The read may block, so let what's been printed so far go out first.
+    flushOutput(&vm->output);
+    if (window->start > 0) {
+        memmove(window->buffer, window->buffer + window->start, window->count - window->start);
+        window->count -= window->start;
+        window->start = 0;
+    }
+    if (window->capacity < window->count + STREAM_BLOCK + 1) {
+        size_t oldCapacity = window->capacity;
+        window->capacity = GROW_CAPACITY(oldCapacity) + STREAM_BLOCK;
+        window->buffer = GROW_ARRAY(char, window->buffer, oldCapacity, window->capacity);
+    }
+    // Not fread(), which would wait for a whole block from a pipe.
+    ssize_t bytesRead;
+    do {
+        bytesRead = read(window->fd, window->buffer + window->count,
+                         window->capacity - window->count - 1);
+    } while (bytesRead < 0 && errno == EINTR);
+    if (bytesRead > 0) window->count += (size_t) bytesRead;
+    else {
+        window->eof = true;
+        window->failed = bytesRead < 0;
+    }
+    window->buffer[window->count] = '\0';
+}
+
+// A brace after anything else opens a map literal, which doesn't end a declaration.
+static bool startsBlock(TokenType previous){
+    switch (previous) {
+        case TOKEN_SEMICOLON:
+        case TOKEN_RIGHT_PAREN:
+        case TOKEN_LEFT_BRACE:
+        case TOKEN_RIGHT_BRACE:
+        case TOKEN_ELSE:
+        case TOKEN_IDENTIFIER: // class Name {
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Finds the end of the first declaration in the window. Returns false if
+ * more input is needed to tell, because a token (or the lookahead for an
+ * `else`) runs into the end of what has been read so far. */
+static bool findDeclaration(Window* window, size_t* end, int* endLine){
+    const char* limit = window->buffer + window->count;
+    Scanner scanner;
+    initScanner(&scanner, window->buffer + window->start);
+    scanner.line = window->line;
+
+    int depth = 0;
+    // Whether the outermost brace is a block's, rather than a map literal's.
+    bool inBlock = false;
+    TokenType previous = TOKEN_SEMICOLON;
+    // Only an `if` outside any brackets, even one nested as a loop's body,
+    // can go on with an `else`, so without one there's no lookahead.
+    bool sawIf = false;
+    Token token = scanToken(&scanner);
+    while (true) {
+        if (!window->eof && scanner.current == limit) return false;
+        if (token.type == TOKEN_EOF) {
+            *end = window->count;
+            *endLine = scanner.line;
+            return true;
+        }
+
+        switch (token.type) {
+            case TOKEN_IF:
+                if (depth <= 0) sawIf = true;
+                break;
+            case TOKEN_LEFT_BRACE:
+                if (depth == 0) inBlock = startsBlock(previous);
+                depth++;
+                break;
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACKET: depth++; break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACKET:
+            case TOKEN_RIGHT_BRACE: depth--; break;
+            default: break;
+        }
+        bool boundary = depth <= 0
+                && (token.type == TOKEN_SEMICOLON || (token.type == TOKEN_RIGHT_BRACE && inBlock));
+        if (boundary && !sawIf) {
+            *end = scanner.current - window->buffer;
+            *endLine = scanner.line;
+            return true;
+        }
+        size_t after = scanner.current - window->buffer;
+        int afterLine = scanner.line;
+
+        previous = token.type;
+        token = scanToken(&scanner);
+        if (boundary && token.type != TOKEN_ELSE) {
+            if (!window->eof && scanner.current == limit) return false;
+            *end = after;
+            *endLine = afterLine;
+            return true;
+        }
+    }
+}
+
+static bool onlyWhitespace(Window* window){
+    Scanner scanner;
+    initScanner(&scanner, window->buffer + window->start);
+    return scanToken(&scanner).type == TOKEN_EOF;
+}
+
+InterpretResult interpretStream(VM* vm, int fd, bool* readFailed){
+    Window window = {fd, NULL, 0, 0, 0, false, false, 1};
+    readMore(vm, &window);
+
+    // Fibers spawned by one declaration may wait on the next, so they only
+    // get the queue to themselves once the input is used up.
+    vm->holdFibers = true;
+    InterpretResult result = INTERPRET_OK;
+    while (result == INTERPRET_OK && !(window.eof && onlyWhitespace(&window))) {
+        size_t end;
+        int endLine;
+        if (!findDeclaration(&window, &end, &endLine)) {
+            readMore(vm, &window);
+            continue;
+        }
+
+        // Cut the declaration off the rest of the window while it compiles.
+        char next = window.buffer[end];
+        window.buffer[end] = '\0';
+        Chunk chunk;
+        initChunk(&chunk);
+        bool compiled = compileFrom(vm, window.buffer + window.start, window.line, &chunk);
+        window.buffer[end] = next;
+        window.start = end;
+        window.line = endLine;
+
+        result = compiled ? interpretChunk(vm, &chunk) : INTERPRET_COMPILE_ERROR;
+        freeChunk(&chunk);
+    }
+    if (result == INTERPRET_OK) result = runQueued(vm);
+    vm->holdFibers = false;
+
+    FREE_ARRAY(char, window.buffer, window.capacity);
+    *readFailed = window.failed;
+    return result;
+}
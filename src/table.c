@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -5,11 +6,30 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "timeline.h"
+
+#ifdef DEBUG_STATS
+#define RECORD_PROBES(table, probes) recordProbes(&(table)->stats, (probes))
+#define STATS(statement) statement
+
+static void recordProbes(TableStats* stats, int probes){
+    stats->lookups++;
+    stats->probes += probes;
+    stats->probeHistogram[probes < TABLE_PROBE_BUCKETS ? probes - 1 : TABLE_PROBE_BUCKETS - 1]++;
+    if (probes > stats->maxProbes) stats->maxProbes = probes;
+}
+#else
+#define RECORD_PROBES(table, probes) ((void) 0)
+#define STATS(statement) ((void) 0)
+#endif
 
 void initTable(Table* table){
     table->capacity = 0;
     table->count = 0;
     table->entries = NULL;
+#ifdef DEBUG_STATS
+    memset(&table->stats, 0, sizeof(TableStats));
+#endif
 }
 
 void freeTable(Table* table){
@@ -17,13 +37,50 @@ void freeTable(Table* table){
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
-    uint32_t index = key->hash % capacity;
+static uint32_t hashBits(uint64_t bits){
+    // The murmur3 finalizer: doubles that are whole numbers have all their
+    // low bits clear, and tables index by the low bits.
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static inline uint32_t hashValue(Value key){
+    switch (key.type) {
+        case VAL_BOOL: return AS_BOOL(key) ? 3 : 5;
+        case VAL_NUMBER: {
+            // -0 == 0, so they must hash alike.
+            double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            return hashBits(bits);
+        }
+        case VAL_OBJ:
+            if (IS_STRING(key)) return AS_STRING(key)->hash;
+            return hashBits((uintptr_t) AS_OBJ(key));
+        default: return 0; // Nil is never a key.
+    }
+}
+
+static inline bool keysEqual(Value a, Value b){
+    if (a.type != b.type) return false;
+    if (a.type == VAL_NUMBER) return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a.type == VAL_BOOL) return AS_BOOL(a) == AS_BOOL(b);
+    return AS_OBJ(a) == AS_OBJ(b);
+}
+
+static inline Entry* findEntry(Entry* entries, int capacity, Value key, uint32_t hash, int* probes){
+    uint32_t index = hash % capacity;
     Entry* tombstone = NULL;
+    *probes = 0;
 
     while (true) {
         Entry* entry = &entries[index];
-        if (entry->key == NULL) {
+        (*probes)++;
+        if (IS_NIL(entry->key)) {
             if (IS_NIL(entry->value))
                 return tombstone != NULL ? tombstone : entry;
             else {
@@ -31,7 +88,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
                     tombstone = entry;
             }
         }
-        else if (entry->key == key)
+        else if (keysEqual(entry->key, key))
             return entry;
 
         index = (index + 1) % capacity;
@@ -39,18 +96,21 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
 }
 
 static void adjustCapacity(Table* table, int capacity){
+    TIMELINE_BEGIN("adjustCapacity");
+    TIMELINE_INSTANT("table capacity", capacity);
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i=0; i<capacity; i++){
-        entries[i].key = NULL;
+        entries[i].key = NIL_VAL;
         entries[i].value = NIL_VAL;
     }
 
     table->count = 0;
     for (int i=0; i<table->capacity; i++){
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (IS_NIL(entry->key)) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
+        int probes;
+        Entry* dest = findEntry(entries, capacity, entry->key, hashValue(entry->key), &probes);
         dest->key = entry->key;
         dest->value = entry->value;
         table->count++;
@@ -59,50 +119,93 @@ static void adjustCapacity(Table* table, int capacity){
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
+    STATS(table->stats.tombstones = 0);
+    STATS(table->stats.resizes++);
+    TIMELINE_END("adjustCapacity");
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value){
+static inline bool getHashed(Table* table, Value key, uint32_t hash, Value* value){
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int probes;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash, &probes);
+    RECORD_PROBES(table, probes);
+    if (IS_NIL(entry->key)) return false;
 
     *value = entry->value;
     return true;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value){
+static inline bool setHashed(Table* table, Value key, uint32_t hash, Value value){
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
 //        GROW_ARRAY(Entry, table->entries, table->capacity, capacity); // Wrong
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    int probes;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash, &probes);
+    RECORD_PROBES(table, probes);
+    bool isNewKey = IS_NIL(entry->key);
     if (isNewKey && IS_NIL(entry->value)) table->count++;
+    else if (isNewKey) STATS(table->stats.tombstones--);
 
     entry->key = key;
     entry->value = value;
     return isNewKey;
 }
 
-bool tableDelete(Table* table, ObjString* key){
+static inline bool deleteHashed(Table* table, Value key, uint32_t hash){
     if(table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int probes;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash, &probes);
+    RECORD_PROBES(table, probes);
+    if (IS_NIL(entry->key)) return false;
 
-    entry->key = NULL;
+    entry->key = NIL_VAL;
     entry->value = BOOL_VAL(true);
+    STATS(table->stats.tombstones++);
     return true;
 }
 
+// String keys bring their hash along.
+
+bool tableGet(Table* table, ObjString* key, Value* value){
+    return getHashed(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool tableSet(Table* table, ObjString* key, Value value){
+    return setHashed(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool tableDelete(Table* table, ObjString* key){
+    return deleteHashed(table, OBJ_VAL(key), key->hash);
+}
+
+bool tableGetValue(Table* table, Value key, Value* value){
+    return getHashed(table, key, hashValue(key), value);
+}
+
+bool tableSetValue(Table* table, Value key, Value value){
+    return setHashed(table, key, hashValue(key), value);
+}
+
+bool tableDeleteValue(Table* table, Value key){
+    return deleteHashed(table, key, hashValue(key));
+}
+
+void tableReserve(Table* table, int count){
+    int capacity = GROW_CAPACITY(0);
+    while (count > capacity * TABLE_MAX_LOAD) capacity *= 2;
+    if (capacity > table->capacity) adjustCapacity(table, capacity);
+}
+
 void tableAddAll(Table* from, Table* to){
     for (int i=0; i<from->capacity; i++){
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL){
-            tableSet(to, entry->key, entry->value);
+        if (!IS_NIL(entry->key)){
+            tableSetValue(to, entry->key, entry->value);
         }
     }
 }
@@ -111,17 +214,51 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
     if (table->count == 0) return NULL;
 
     uint32_t index = hash % table->capacity;
+    int probes = 0;
     while (true) {
         Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
+        probes++;
+        if (IS_NIL(entry->key)) {
             // Empty none-tombstone entry
-            if (IS_NIL(entry->value)) return NULL;
+            if (IS_NIL(entry->value)) {
+                RECORD_PROBES(table, probes);
+                return NULL;
+            }
+        }
+        else {
+            ObjString* key = AS_STRING(entry->key);
+            if (key->length == length && key->hash == hash
+                && memcmp(key->chars, chars, length) == 0) {
+                RECORD_PROBES(table, probes);
+                return key;
+            }
         }
-        else if (entry->key->length == length
-                && entry->key->hash == hash
-                && memcmp(entry->key->chars, chars, length) == 0)
-            return entry->key;
 
         index = (index + 1) % table->capacity;
     }
 }
+
+#ifdef DEBUG_STATS
+void printTableStats(FILE* out, const char* name, Table* table){
+    TableStats* stats = &table->stats;
+    int live = table->count - stats->tombstones;
+
+    fprintf(out, "%s:\n", name);
+    fprintf(out, "  entries %d, tombstones %d, capacity %d, load %.3f (max %.2f)\n",
+            live, stats->tombstones, table->capacity,
+            table->capacity == 0 ? 0.0 : (double) table->count / table->capacity,
+            TABLE_MAX_LOAD);
+    fprintf(out, "  resizes %d, lookups %llu, mean probes %.3f, max probes %d\n",
+            stats->resizes, (unsigned long long) stats->lookups,
+            stats->lookups == 0 ? 0.0 : (double) stats->probes / stats->lookups,
+            stats->maxProbes);
+
+    for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+        if (stats->probeHistogram[i] == 0) continue;
+        fprintf(out, "  %2d%s probes: %llu (%.1f%%)\n",
+                i + 1, i == TABLE_PROBE_BUCKETS - 1 ? "+" : " ",
+                (unsigned long long) stats->probeHistogram[i],
+                100.0 * stats->probeHistogram[i] / stats->lookups);
+    }
+}
+#endif
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timeline.h"
+
+typedef struct {
+    atomic_uint_fast64_t sequence;
+    const char* name;
+    int64_t timestamp;
+    int64_t value;
+    int thread;
+    char phase;
+} TimelineEvent;
+
+static TimelineEvent events[TIMELINE_CAPACITY];
+static atomic_uint_fast64_t nextEvent = 0;
+static atomic_int nextThread = 0;
+static _Thread_local int threadId = -1;
+
+static const char* dumpPath = NULL;
+
+int64_t timelineClock(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Writers claim a slot with a single fetch-add and publish it by storing the
+ * slot's sequence number last, so readers can skip torn or overwritten slots. */
+void timelineRecord(const char* name, char phase, int64_t value){
+    if (threadId == -1) threadId = atomic_fetch_add(&nextThread, 1);
+
+    uint_fast64_t index = atomic_fetch_add_explicit(&nextEvent, 1, memory_order_relaxed);
+    TimelineEvent* event = &events[index & (TIMELINE_CAPACITY - 1)];
+    atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+    // Keeps the writes below from being seen before the slot is marked torn.
+    atomic_thread_fence(memory_order_release);
+    event->name = name;
+    event->timestamp = timelineClock();
+    event->value = value;
+    event->thread = threadId;
+    event->phase = phase;
+    atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+}
+
+/*********       Output       *********/
+
+/* The dump only uses write(2) and hand-rolled formatting so it's safe to run
+ * from a signal handler. */
+
+typedef struct {
+    int fd;
+    int count;
+    char data[4096];
+} Output;
+
+static void flushOutput(Output* out){
+    int written = 0;
+    while (written < out->count) {
+        ssize_t n = write(out->fd, out->data + written, out->count - written);
+        if (n <= 0) break;
+        written += (int) n;
+    }
+    out->count = 0;
+}
+
+static void writeChars(Output* out, const char* chars){
+    for (; *chars != '\0'; chars++) {
+        if (out->count == sizeof(out->data)) flushOutput(out);
+        out->data[out->count++] = *chars;
+    }
+}
+
+static void writeInt(Output* out, int64_t value){
+    char digits[24];
+    int length = 0;
+    bool negative = value < 0;
+    uint64_t magnitude = negative ? -(uint64_t) value : (uint64_t) value;
+
+    do {
+        digits[length++] = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    char text[26];
+    int i = 0;
+    if (negative) text[i++] = '-';
+    while (length > 0) text[i++] = digits[--length];
+    text[i] = '\0';
+    writeChars(out, text);
+}
+
+static void writeEvent(Output* out, TimelineEvent* event, int pid){
+    char phase[2] = {event->phase, '\0'};
+
+    writeChars(out, "{\"name\":\"");
+    writeChars(out, event->name);
+    writeChars(out, "\",\"ph\":\"");
+    writeChars(out, phase);
+    writeChars(out, "\",\"ts\":");
+    writeInt(out, event->timestamp / 1000);
+    writeChars(out, ".");
+    char fraction[4] = {
+        (char) ('0' + event->timestamp / 100 % 10),
+        (char) ('0' + event->timestamp / 10 % 10),
+        (char) ('0' + event->timestamp % 10),
+        '\0'
+    };
+    writeChars(out, fraction);
+    writeChars(out, ",\"pid\":");
+    writeInt(out, pid);
+    writeChars(out, ",\"tid\":");
+    writeInt(out, event->thread);
+    if (event->phase == 'i') {
+        writeChars(out, ",\"s\":\"t\",\"args\":{\"value\":");
+        writeInt(out, event->value);
+        writeChars(out, "}");
+    }
+    writeChars(out, "}");
+}
+
+bool timelineDump(const char* path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    Output out;
+    out.fd = fd;
+    out.count = 0;
+    int pid = (int) getpid();
+
+    uint_fast64_t end = atomic_load_explicit(&nextEvent, memory_order_acquire);
+    uint_fast64_t start = end > TIMELINE_CAPACITY ? end - TIMELINE_CAPACITY : 0;
+
+    writeChars(&out, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (uint_fast64_t i = start; i < end; i++) {
+        TimelineEvent* event = &events[i & (TIMELINE_CAPACITY - 1)];
+        if (atomic_load_explicit(&event->sequence, memory_order_acquire) != i + 1) continue;
+
+        // Copied, then kept only if no writer claimed the slot meanwhile.
+        TimelineEvent copy;
+        copy.name = event->name;
+        copy.timestamp = event->timestamp;
+        copy.value = event->value;
+        copy.thread = event->thread;
+        copy.phase = event->phase;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&event->sequence, memory_order_relaxed) != i + 1) continue;
+
+        if (!first) writeChars(&out, ",\n");
+        first = false;
+        writeEvent(&out, &copy, pid);
+    }
+    writeChars(&out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    flushOutput(&out);
+    close(fd);
+    return true;
+}
+
+static void dumpOnSignal(int signum){
+    if (dumpPath != NULL) timelineDump(dumpPath);
+}
+
+void installTimelineSignal(const char* path){
+    dumpPath = path;
+#ifdef SIGUSR2
+    signal(SIGUSR2, dumpOnSignal);
+#endif
+}
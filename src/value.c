@@ -4,6 +4,7 @@
 #include "value.h"
 #include "memory.h"
 #include "object.h"
+#include "number.h"
 
 bool isFalsey(Value value){
     if (value.type == VAL_NUMBER) return AS_NUMBER(value) == 0;
@@ -53,19 +54,47 @@ void freeValueArray(ValueArray* array){
     initValueArray(array);
 }
 
+void initNumberArray(NumberArray* array){
+    array->count = 0;
+    array->capacity = 0;
+    array->values = NULL;
+}
+
+void writeNumberArray(NumberArray* array, double number){
+    if (array->capacity < array->count + 1){
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(double, array->values, oldCapacity, array->capacity);
+    }
+
+    array->values[array->count] = number;
+    array->count++;
+}
+
+void freeNumberArray(NumberArray* array){
+    FREE_ARRAY(double, array->values, array->capacity);
+    initNumberArray(array);
+}
+
 void printValue(Value value){
+    fprintValue(stdout, value);
+}
+
+void fprintValue(FILE* out, Value value){
     switch (value.type) {
         case VAL_BOOL:
-            printf("%s", AS_BOOL(value) ? "true" : "false");
+            fprintf(out, "%s", AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL:
-            printf("%s", "nil");
+            fprintf(out, "%s", "nil");
             break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            fwrite(buffer, 1, formatNumber(AS_NUMBER(value), buffer), out);
             break;
+        }
         case VAL_OBJ:
-            printObject(value);
+            printObject(out, value);
             break;
     }
 }
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vector.h"
+#include "memory.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*********     Reductions     *********/
+
+double sumNumbers(const double* numbers, int count){
+    int i = 0;
+    double sum = 0;
+#ifdef __SSE2__
+    // Four lanes in two registers, to keep two additions in flight.
+    __m128d low = _mm_setzero_pd();
+    __m128d high = _mm_setzero_pd();
+    for (; i + 4 <= count; i += 4) {
+        low = _mm_add_pd(low, _mm_loadu_pd(numbers + i));
+        high = _mm_add_pd(high, _mm_loadu_pd(numbers + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(low, high));
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < count; i++) sum += numbers[i];
+    return sum;
+}
+
+// Whether every number is a NaN, for the rare case a min or max comes out infinite.
+static bool allNaN(const double* numbers, int count){
+    for (int i = 0; i < count; i++)
+        if (!isnan(numbers[i])) return false;
+    return true;
+}
+
+/* minpd/maxpd return their second operand when either is a NaN, so keeping
+ * the running result second skips NaNs the same way the scalar tail does. */
+
+double minNumbers(const double* numbers, int count){
+    int i = 0;
+    double min = INFINITY;
+#ifdef __SSE2__
+    __m128d lanes = _mm_set1_pd(INFINITY);
+    for (; i + 2 <= count; i += 2) lanes = _mm_min_pd(_mm_loadu_pd(numbers + i), lanes);
+    double parts[2];
+    _mm_storeu_pd(parts, lanes);
+    min = parts[0] < parts[1] ? parts[0] : parts[1];
+#endif
+    for (; i < count; i++) min = numbers[i] < min ? numbers[i] : min;
+    if (min == INFINITY && allNaN(numbers, count)) return NAN;
+    return min;
+}
+
+double maxNumbers(const double* numbers, int count){
+    int i = 0;
+    double max = -INFINITY;
+#ifdef __SSE2__
+    __m128d lanes = _mm_set1_pd(-INFINITY);
+    for (; i + 2 <= count; i += 2) lanes = _mm_max_pd(_mm_loadu_pd(numbers + i), lanes);
+    double parts[2];
+    _mm_storeu_pd(parts, lanes);
+    max = parts[0] > parts[1] ? parts[0] : parts[1];
+#endif
+    for (; i < count; i++) max = numbers[i] > max ? numbers[i] : max;
+    if (max == -INFINITY && allNaN(numbers, count)) return NAN;
+    return max;
+}
+
+double dotNumbers(const double* a, const double* b, int count){
+    int i = 0;
+    double dot = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd();
+    __m128d high = _mm_setzero_pd();
+    for (; i + 4 <= count; i += 4) {
+        low = _mm_add_pd(low, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        high = _mm_add_pd(high, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(low, high));
+    dot = lanes[0] + lanes[1];
+#endif
+    for (; i < count; i++) dot += a[i] * b[i];
+    return dot;
+}
+
+/**************************************/
+
+/*********    Elementwise     *********/
+
+void addNumbers(double* result, const double* a, const double* b, int count){
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(result + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+#endif
+    for (; i < count; i++) result[i] = a[i] + b[i];
+}
+
+void scaleNumbers(double* result, const double* numbers, double factor, int count){
+    int i = 0;
+#ifdef __SSE2__
+    __m128d factors = _mm_set1_pd(factor);
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(result + i, _mm_mul_pd(_mm_loadu_pd(numbers + i), factors));
+#endif
+    for (; i < count; i++) result[i] = numbers[i] * factor;
+}
+
+/**************************************/
+
+/*********      Sorting       *********/
+
+/* An LSD radix sort on the doubles' bits, remapped so that unsigned order
+ * is numeric order: negatives have every bit flipped, positives just the
+ * sign bit, and NaNs (of either sign) become the largest key. */
+
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+#define INSERTION_SORT_MAX 48
+
+static uint64_t sortKey(double number){
+    if (isnan(number)) return UINT64_MAX;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (UINT64_C(1) << 63);
+}
+
+static double keyNumber(uint64_t key){
+    uint64_t bits = (key >> 63) ? key & ~(UINT64_C(1) << 63) : ~key;
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+static void insertionSort(uint64_t* keys, int count){
+    for (int i = 1; i < count; i++) {
+        uint64_t key = keys[i];
+        int j = i;
+        for (; j > 0 && keys[j - 1] > key; j--) keys[j] = keys[j - 1];
+        keys[j] = key;
+    }
+}
+
+static void radixSort(uint64_t* keys, uint64_t* scratch, int count){
+    // All the histograms come from one pass over the keys.
+    uint32_t histograms[RADIX_PASSES][RADIX_SIZE];
+    memset(histograms, 0, sizeof(histograms));
+    for (int i = 0; i < count; i++)
+        for (int pass = 0; pass < RADIX_PASSES; pass++)
+            histograms[pass][(keys[i] >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+
+    uint64_t* from = keys;
+    uint64_t* to = scratch;
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        uint32_t* histogram = histograms[pass];
+        int shift = pass * RADIX_BITS;
+        // A digit every key shares doesn't reorder anything.
+        if (histogram[(from[0] >> shift) & (RADIX_SIZE - 1)] == (uint32_t) count) continue;
+
+        uint32_t offset = 0;
+        for (int digit = 0; digit < RADIX_SIZE; digit++) {
+            uint32_t size = histogram[digit];
+            histogram[digit] = offset;
+            offset += size;
+        }
+        for (int i = 0; i < count; i++)
+            to[histogram[(from[i] >> shift) & (RADIX_SIZE - 1)]++] = from[i];
+
+        uint64_t* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != keys) memcpy(keys, from, sizeof(uint64_t) * count);
+}
+
+void sortNumbers(double* numbers, int count){
+    if (count < 2) return;
+    uint64_t* keys = ALLOCATE(uint64_t, count);
+    for (int i = 0; i < count; i++) keys[i] = sortKey(numbers[i]);
+
+    if (count <= INSERTION_SORT_MAX) insertionSort(keys, count);
+    else {
+        uint64_t* scratch = ALLOCATE(uint64_t, count);
+        radixSort(keys, scratch, count);
+        FREE_ARRAY(uint64_t, scratch, count);
+    }
+
+    for (int i = 0; i < count; i++) numbers[i] = keyNumber(keys[i]);
+    FREE_ARRAY(uint64_t, keys, count);
+}
+
+/**************************************/
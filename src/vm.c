@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,97 +9,524 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "timeline.h"
+#include "jit.h"
+#include "image.h"
+#include "fiber.h"
 
-VM vm;
+/* Bumped from SIGUSR1. Every VM compares it with the count it last acted
+ * on, so one signal toggles tracing in all of them; the untraced loop only
+ * polls it on backward jumps. */
+static volatile sig_atomic_t traceToggles = 0;
 
-static void resetStack(){
-    vm.stackTop = vm.stack;
-}
+/* Returned by execute() when it stops so run() can swap to the other loop. */
+#define INTERPRET_SWITCH_LOOP ((InterpretResult) -1)
+/* Returned by the loop run under --jit when native code could take over. */
+#define INTERPRET_ENTER_JIT ((InterpretResult) -2)
+
+// Frames listed at each end of a runtime error's trace.
+#define TRACE_FRAMES 10
 
-static void runtimeError(const char* format, ...){
+void runtimeError(VM* vm, const char* format, ...){
+    // Whatever was printed before the error comes first.
+    flushOutput(&vm->output);
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->errOut, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->errOut);
+
+    if (vm->frameCount > 0) vm->frames[vm->frameCount - 1].ip = vm->ip;
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        // A deep trace keeps its innermost and outermost frames.
+        if (i == vm->frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+            fprintf(vm->errOut, "... %d more frames ...\n", i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES - 1;
+        }
+        CallFrame* frame = &vm->frames[i];
+        size_t instruction = frame->ip - frame->chunk->code - 1;
+        int line = frame->chunk->lines[instruction];
+        if (frame->function == NULL)
+            fprintf(vm->errOut, "[line %d] in script\n", line);
+        else
+            fprintf(vm->errOut, "[line %d] in %s()\n", line, frame->function->name->chars);
+    }
+    resetFibers(vm);
+}
+
+void initVM(VM* vm){
+    initIoLoop(&vm->io);
+    initFibers(vm);
+    vm->objects = NULL;
+    vm->image = NULL;
+    vm->imageSize = 0;
+    vm->imageJit = NULL;
+    vm->imageJitCount = 0;
+    vm->imageJitCapacity = 0;
+    initChunkCache(&vm->chunks, CHUNK_CACHE_CAPACITY);
+    initWorkerPool(&vm->workers, defaultPoolSize());
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    vm->sharedStrings = NULL;
+
+    initOutput(&vm->output, stdout);
+    vm->errOut = stderr;
+    vm->traceOut = stdout;
+    vm->traceToggleSeen = traceToggles;
+    vm->startupClock = 0;
+#ifdef DEBUG_STATS
+    vm->internHits = 0;
+    vm->internMisses = 0;
+    vm->dispatches = 0;
+#endif
+    vm->registerCode = false;
+    vm->jit = false;
+#ifdef DEBUG_PRINT_CODE
+    vm->printCode = true;
+#else
+    vm->printCode = false;
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    vm->traceExecution = true;
+#else
+    vm->traceExecution = false;
+#endif
+}
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+void freeVM(VM* vm){
+    freeOutput(&vm->output);
+    freeChunkCache(&vm->chunks);
+    freeWorkerPool(&vm->workers);
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
+    freeFibers(vm);
+    freeIoLoop(&vm->io);
+    freeObjects(vm);
+    freeImage(vm);
 }
 
-void initVM(){
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+void printVMStats(VM* vm, FILE* out){
+#ifdef DEBUG_STATS
+    uint64_t interns = vm->internHits + vm->internMisses;
+    fprintf(out, "=== stats ===\n");
+    fprintf(out, "dispatches: %llu\n", (unsigned long long) vm->dispatches);
+    fprintf(out, "interning: %llu hits, %llu misses (%.1f%% hit rate)\n",
+            (unsigned long long) vm->internHits, (unsigned long long) vm->internMisses,
+            interns == 0 ? 0.0 : 100.0 * vm->internHits / interns);
+    fprintf(out, "chunk cache: %llu hits, %llu misses, %d cached\n",
+            (unsigned long long) vm->chunks.hits, (unsigned long long) vm->chunks.misses,
+            vm->chunks.count);
+    printTableStats(out, "vm.strings", &vm->strings);
+    printTableStats(out, "vm.globals", &vm->globals);
+#else
+    fprintf(out, "Stats unavailable: built without DEBUG_STATS.\n");
+#endif
+}
+
+static void toggleTrace(int signum){
+    traceToggles++;
 }
 
-void freeVM(){
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+void installTraceSignal(){
+#ifdef SIGUSR1
+    signal(SIGUSR1, toggleTrace);
+#endif
 }
 
-void push(Value value){
-    *vm.stackTop = value;
-    vm.stackTop++;
-//    if (vm.stackTop == &vm.stack[STACK_MAX]){
-//        vm.stack = GROW_ARRAY(uint8_t, &vm.stack, STACK_MAX, STACK_MAX*2);
+void push(VM* vm, Value value){
+    *vm->stackTop = value;
+    vm->stackTop++;
+//    if (vm->stackTop == &vm->stack[STACK_MAX]){
+//        vm->stack = GROW_ARRAY(uint8_t, &vm->stack, STACK_MAX, STACK_MAX*2);
 //    }
 }
 
-Value pop(){
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm){
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(VM* vm, int distance){
+    return vm->stackTop[-1 - distance];
+}
+
+ObjNative* defineNative(VM* vm, const char* name, NativeFn function, int arity){
+    ObjString* string = copyString(vm, name, (int) strlen(name));
+    ObjNative* native = newNative(vm, function, arity, string);
+    // A global the image kept is the script's own, which replaced the native
+    // when it ran; the natives it held were left as tombstones.
+    Value existing;
+    if (vm->image != NULL && tableGet(&vm->globals, string, &existing)) return native;
+    tableSet(&vm->globals, string, OBJ_VAL(native));
+    return native;
+}
+
+static bool checkArity(VM* vm, ObjFunction* function, int argCount){
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    return true;
+}
+
+static bool call(VM* vm, ObjFunction* function, int argCount){
+    if (!checkArity(vm, function, argCount)) return false;
+    if (vm->frameCount == vm->fiber->frameCapacity && !growFrames(vm)) return false;
+    // Room for the whole call is made up front, see maxStackDepth().
+    int base = (int) (vm->stackTop - vm->fiber->stack) - argCount - 1;
+    int needed = base + function->chunk.maxStack;
+    if (needed > vm->fiber->stackCapacity && !growStack(vm, needed)) return false;
+
+    vm->frames[vm->frameCount - 1].ip = vm->ip;
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = function;
+    frame->chunk = &function->chunk;
+    frame->slots = vm->fiber->stack + base;
+
+    vm->chunk = frame->chunk;
+    vm->ip = function->chunk.code;
+    vm->slots = frame->slots;
+    return true;
+}
+
+/* `return f(args)`: the callee reuses the caller's frame, moving itself and
+ * its arguments down over the caller's slots, so tail recursion runs in
+ * constant stack space. Natives just get called; the OP_RETURN after the
+ * call returns their result. */
+static bool tailCall(VM* vm, Value callee, int argCount){
+    if (!IS_FUNCTION(callee) || vm->frames[vm->frameCount - 1].function == NULL)
+        return callValue(vm, callee, argCount);
+
+    ObjFunction* function = AS_FUNCTION(callee);
+    if (!checkArity(vm, function, argCount)) return false;
+    int needed = (int) (vm->slots - vm->fiber->stack) + function->chunk.maxStack;
+    if (needed > vm->fiber->stackCapacity && !growStack(vm, needed)) return false;
+
+    Value* callArgs = vm->stackTop - argCount - 1;
+    memmove(vm->slots, callArgs, sizeof(Value) * (argCount + 1));
+    vm->stackTop = vm->slots + argCount + 1;
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    frame->function = function;
+    frame->chunk = &function->chunk;
+    vm->chunk = frame->chunk;
+    vm->ip = function->chunk.code;
+    return true;
+}
+
+bool callValue(VM* vm, Value callee, int argCount){
+    if (IS_FUNCTION(callee)) return call(vm, AS_FUNCTION(callee), argCount);
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+    }
+    if (IS_CLASS(callee)) {
+        // The new instance takes the class's slot, where init() finds `this`.
+        ObjClass* klass = AS_CLASS(callee);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        if (klass->initializer != NULL) return call(vm, klass->initializer, argCount);
+        if (argCount != 0) {
+            runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+            return false;
+        }
+        return true;
+    }
+    if (IS_NATIVE(callee)) {
+        // Natives run straight off the VM stack, without a frame of their own.
+        ObjNative* native = AS_NATIVE(callee);
+        if (native->arity != -1 && argCount != native->arity) {
+            runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+            return false;
+        }
+        Value* args = vm->stackTop - argCount;
+        ObjFiber* fiber = vm->fiber;
+        if (!native->function(vm, argCount, args)) return false;
+        // One that switched fibers has already left this one's stack top in place.
+        if (vm->fiber == fiber) vm->stackTop = args;
+        return true;
+    }
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
 }
 
-static Value peek(int distance){
-    return vm.stackTop[-1 - distance];
+// Checks that `index` is a whole number inside `list` and returns it as an int.
+static bool listIndex(VM* vm, ObjList* list, Value index, int* result){
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "List index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < listCount(list)) || number != (int) number) {
+        runtimeError(vm, "List index %g out of range for a list of %d.", number, listCount(list));
+        return false;
+    }
+    *result = (int) number;
+    return true;
+}
+
+// Nil can't be a key and a NaN key could never be found again.
+static bool checkMapKey(VM* vm, Value key){
+    if (IS_NIL(key)) {
+        runtimeError(vm, "Map key can't be nil.");
+        return false;
+    }
+    if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+        runtimeError(vm, "Map key can't be NaN.");
+        return false;
+    }
+    return true;
 }
 
-static void concatenate(){
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length+1] = '\0';
+/*********     Properties     *********/
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+/* Every property instruction has an inline cache of what it did for the
+ * last few shapes it saw, so a hit skips both the walk up the shape chain
+ * and the method table. A shape's fields never change and methods are all
+ * in place before the class's first instance exists, so entries stay valid
+ * for good. */
+
+static inline CacheEntry* lookupCache(InlineCache* cache, ObjShape* shape){
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void fillCache(InlineCache* cache, ObjShape* shape, Obj* target, int index){
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape != NULL) continue;
+        entry->shape = shape;
+        entry->target = target;
+        entry->index = index;
+        return;
+    }
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_SHORT() (vm.ip += 2, (uint16_t) ((vm.ip[-2] << 8) | vm.ip[-1]))
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name){
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, peek(vm, 0), AS_FUNCTION(method)));
+    return true;
+}
+
+// Replaces the instance on top of the stack with its property `name`.
+static inline bool getProperty(VM* vm, ObjString* name, InlineCache* cache){
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+    CacheEntry* entry = lookupCache(cache, instance->shape);
+    if (entry != NULL) {
+        vm->stackTop[-1] = instance->fields[entry->index];
+        return true;
+    }
+
+    int index = shapeField(instance->shape, name);
+    if (index == -1) return bindMethod(vm, instance->klass, name);
+    fillCache(cache, instance->shape, NULL, index);
+    vm->stackTop[-1] = instance->fields[index];
+    return true;
+}
+
+// Stores the top of the stack into the instance below it and leaves the value.
+static inline bool setProperty(VM* vm, ObjString* name, InlineCache* cache){
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+    ObjShape* next;
+    int index;
+    CacheEntry* entry = lookupCache(cache, instance->shape);
+    if (entry != NULL) {
+        next = (ObjShape*) entry->target;
+        index = entry->index;
+    }
+    else {
+        next = instance->shape;
+        index = shapeField(instance->shape, name);
+        if (index == -1) {
+            next = shapeTransition(vm, instance->shape, name);
+            index = next->fieldCount - 1;
+        }
+        fillCache(cache, instance->shape, (Obj*) next, index);
+    }
+
+    if (next != instance->shape) reshapeInstance(vm, instance, next);
+    instance->fields[index] = peek(vm, 0);
+    vm->stackTop--;
+    vm->stackTop[-1] = instance->fields[index];
+    return true;
+}
+
+// `receiver.name(args)` without making a bound method.
+static inline bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache){
+    Value receiver = peek(vm, argCount);
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError(vm, "Only instances have methods.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    CacheEntry* entry = lookupCache(cache, instance->shape);
+    if (entry != NULL) return call(vm, (ObjFunction*) entry->target, argCount);
+
+    int index = shapeField(instance->shape, name);
+    if (index != -1) {
+        // A field shadows the method; it's called like any other value.
+        vm->stackTop[-argCount - 1] = instance->fields[index];
+        return callValue(vm, instance->fields[index], argCount);
+    }
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    fillCache(cache, instance->shape, AS_OBJ(method), -1);
+    return call(vm, AS_FUNCTION(method), argCount);
+}
+
+// Where `super` looks for methods: the superclass of the running method's class.
+static ObjClass* currentSuperclass(VM* vm){
+    return vm->frames[vm->frameCount - 1].function->owner->superclass;
+}
+
+/**************************************/
+
+static void concatenate(VM* vm){
+    ObjString* b = AS_STRING(pop(vm));
+    ObjString* a = AS_STRING(pop(vm));
+    push(vm, OBJ_VAL(concatenateStrings(vm, a, b)));
+}
+
+// Where OP_SWITCH goes for `value`, counted from the end of the instruction.
+static inline int switchOffset(SwitchTable* table, Value value){
+    if (table->dense) {
+        if (!IS_NUMBER(value)) return table->defaultOffset;
+        double index = AS_NUMBER(value) - table->low;
+        // False for NaN too.
+        if (index >= 0 && index < table->count && index == (int) index)
+            return table->offsets[(int) index];
+        return table->defaultOffset;
+    }
+    Value offset;
+    if (!IS_NIL(value) && tableGetValue(&table->cases, value, &offset)) return (int) AS_NUMBER(offset);
+    return table->defaultOffset;
+}
+
+static inline Value readRegister(VM* vm, uint8_t operand){
+    if (operand & REGISTER_CONSTANT)
+        return vm->chunk->constants.values[operand & REGISTER_MAX];
+    return vm->slots[operand];
+}
+
+static bool addRegisters(VM* vm, Value l, Value r, Value* result){
+    if (IS_NUMBER(l) && IS_NUMBER(r)) {
+        *result = NUMBER_VAL(AS_NUMBER(l) + AS_NUMBER(r));
+        return true;
+    }
+    if (IS_STRING(l) && IS_STRING(r)) {
+        *result = OBJ_VAL(concatenateStrings(vm, AS_STRING(l), AS_STRING(r)));
+        return true;
+    }
+    runtimeError(vm, "Both operands must be either numbers or strings.");
+    return false;
+}
+
+static void traceInstruction(VM* vm){
+    FILE* out = vm->traceOut;
+    if (out == vm->output.file && vm->output.count > 0) flushOutput(&vm->output);
+    fprintf(out, "[");
+    bool first = true;
+    for (Value* slot=vm->fiber->stack; slot < vm->stackTop; slot++) {
+        if (!first) fprintf(out, ", ");
+        first = false;
+        fprintValue(out, *slot);
+    }
+    fprintf(out, "]\n");
+    disassembleInstruction(out, vm->chunk,
+                           (int) (vm->ip - vm->chunk->code));
+}
+
+/* The interpreter loop. It's always inlined with constant `trace` and `jit`
+ * so the traced, untraced and JIT-assisting loops are separate copies of the
+ * same handlers and the untraced one carries no per-instruction check at
+ * all. The `jit` copy stops at loop heads and once it's running another
+ * chunk, where native code can take over again. */
+static FORCE_INLINE InterpretResult execute(VM* vm, const bool trace, const bool jit) {
+#define READ_BYTE() (*vm->ip++)
+#define READ_SHORT() (vm->ip += 2, (uint16_t) ((vm->ip[-2] << 8) | vm->ip[-1]))
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+#define BINARY_OP(valueType, op, quickened) \
     do {\
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)) ) { \
-            runtimeError("Operand must be a number.");\
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1)) ) { \
+            runtimeError(vm, "Operand must be a number.");\
             return INTERPRET_RUNTIME_ERROR;\
         }\
-        double r = AS_NUMBER(pop());\
-        double l = AS_NUMBER(pop());\
-        push(valueType(l op r));\
+        vm->ip[-1] = quickened;\
+        double r = AS_NUMBER(pop(vm));\
+        double l = AS_NUMBER(pop(vm));\
+        push(vm, valueType(l op r));\
+    } while (false)
+#define DESPECIALIZE(generic) \
+    do {\
+        vm->ip[-1] = generic;\
+        vm->ip--;\
+    } while (false)
+#define NUMBER_OP(valueType, op, generic) \
+    do {\
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {\
+            DESPECIALIZE(generic);\
+            break;\
+        }\
+        double r = AS_NUMBER(vm->stackTop[-1]);\
+        vm->stackTop--;\
+        vm->stackTop[-1] = valueType(AS_NUMBER(vm->stackTop[-1]) op r);\
+    } while (false)
+#define UNCHECKED_OP(valueType, op) \
+    do {\
+        double r = AS_NUMBER(vm->stackTop[-1]);\
+        vm->stackTop--;\
+        vm->stackTop[-1] = valueType(AS_NUMBER(vm->stackTop[-1]) op r);\
+    } while (false)
+#define READ_REGISTER() readRegister(vm, READ_BYTE())
+#define REGISTER_OP(valueType, op) \
+    do {\
+        Value l = READ_REGISTER();\
+        Value r = READ_REGISTER();\
+        if (!IS_NUMBER(l) || !IS_NUMBER(r)) {\
+            runtimeError(vm, "Operand must be a number.");\
+            return INTERPRET_RUNTIME_ERROR;\
+        }\
+        push(vm, valueType(AS_NUMBER(l) op AS_NUMBER(r)));\
+    } while (false)
+#define REGISTER_SET_OP(op) \
+    do {\
+        uint8_t slot = READ_BYTE();\
+        Value l = READ_REGISTER();\
+        Value r = READ_REGISTER();\
+        if (!IS_NUMBER(l) || !IS_NUMBER(r)) {\
+            runtimeError(vm, "Operand must be a number.");\
+            return INTERPRET_RUNTIME_ERROR;\
+        }\
+        vm->slots[slot] = NUMBER_VAL(AS_NUMBER(l) op AS_NUMBER(r));\
     } while (false)
 
+    Chunk* entered = vm->chunk;
     while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("[");
-        bool first = true;
-        for (Value* slot=vm.stack; slot < vm.stackTop; slot++) {
-            if (!first) printf(", ");
-            first = false;
-            printValue(*slot);
+        if (trace) {
+            if (traceToggles != vm->traceToggleSeen) return INTERPRET_SWITCH_LOOP;
+            traceInstruction(vm);
         }
-        printf("]\n");
-        disassembleInstruction(vm.chunk,
-                               (int) (vm.ip - vm.chunk->code));
+        if (jit && vm->chunk != entered) return INTERPRET_ENTER_JIT;
+#ifdef DEBUG_STATS
+        vm->dispatches++;
 #endif
 
         uint8_t instruction;
@@ -107,20 +535,20 @@ static InterpretResult run() {
          switch (instruction) {*/
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                push(vm, constant);
                 break;
             }
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+                tableSet(&vm->globals, name, peek(vm, 0));
+                pop(vm);
                 break;
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if (tableSet(&vm->globals, name, peek(vm, 0))) {
+                    tableDelete(&vm->globals, name);
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
@@ -128,97 +556,310 @@ static InterpretResult run() {
             case OP_GET_GLOBAL: {
                 ObjString* name = READ_STRING();
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if (!tableGet(&vm->globals, name, &value)) {
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                push(vm, value);
                 break;
             }
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]);
+                push(vm, vm->slots[slot]);
                 break;
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
+                vm->slots[slot] = peek(vm, 0);
                 break;
             }
 
             /*Binary operations on constants*/
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
+                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    vm->ip[-1] = OP_ADD_STR;
+                    concatenate(vm);
                 }
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double r = AS_NUMBER(pop());
-                    double l = AS_NUMBER(pop());
-                    push(NUMBER_VAL(l + r));
+                else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    vm->ip[-1] = OP_ADD_NUM;
+                    double r = AS_NUMBER(pop(vm));
+                    double l = AS_NUMBER(pop(vm));
+                    push(vm, NUMBER_VAL(l + r));
                 }
                 else {
-                    runtimeError("Both operands must be either numbers or strings.");
+                    runtimeError(vm, "Both operands must be either numbers or strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); break;
+            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); break;
+            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); break;
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+                vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
                 break;
 
             /*Logical values*/
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
+            case OP_NIL: push(vm, NIL_VAL); break;
+            case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+            case OP_FALSE: push(vm, BOOL_VAL(false)); break;
 
             /*Control flow*/
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
+                vm->ip -= offset;
+                if (!trace && traceToggles != vm->traceToggleSeen) return INTERPRET_SWITCH_LOOP;
+                if (jit) return INTERPRET_ENTER_JIT;
                 break;
             }
             case OP_JUMP: {
                 uint16_t offset = READ_SHORT();
-                vm.ip += offset;
+                vm->ip += offset;
                 break;
             }
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
-                vm.ip += isFalsey(peek(0)) * offset;
-//                if (isFalsey(peek(0))) vm.ip += offset;
+                vm->ip += isFalsey(peek(vm, 0)) * offset;
+//                if (isFalsey(peek(vm, 0))) vm->ip += offset;
+                break;
+            }
+            case OP_SWITCH: {
+                SwitchTable* table = &vm->chunk->switches[READ_SHORT()];
+                vm->ip += switchOffset(table, pop(vm));
                 break;
             }
 
             /*Logical operations*/
-            case OP_NOT: vm.stackTop[-1] = BOOL_VAL(isFalsey(vm.stackTop[-1])); break;
+            case OP_NOT: vm->stackTop[-1] = BOOL_VAL(isFalsey(vm->stackTop[-1])); break;
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER: BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); break;
+            case OP_LESS: BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); break;
 
             /*Expression operations*/
             case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
+                printOutput(&vm->output, pop(vm));
+                break;
+            }
+            case OP_POP: pop(vm); break;
+            case OP_CALL: {
+                int argCount = READ_BYTE();
+                if (!callValue(vm, peek(vm, argCount), argCount)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_BUILD_LIST: {
+                int count = READ_BYTE();
+                ObjList* list = newList(vm);
+                for (int i = count; i > 0; i--) listAppend(vm, list, peek(vm, i - 1));
+                vm->stackTop -= count;
+                push(vm, OBJ_VAL(list));
+                break;
+            }
+            case OP_BUILD_MAP: {
+                int count = READ_BYTE();
+                ObjMap* map = newMap(vm);
+                tableReserve(&map->table, count);
+                for (int i = count; i > 0; i--) {
+                    Value key = peek(vm, 2 * i - 1);
+                    if (!checkMapKey(vm, key)) return INTERPRET_RUNTIME_ERROR;
+                    mapSet(vm, map, key, peek(vm, 2 * i - 2));
+                }
+                vm->stackTop -= 2 * count;
+                push(vm, OBJ_VAL(map));
+                break;
+            }
+            case OP_GET_INDEX: {
+                if (IS_MAP(peek(vm, 1))) {
+                    Value value;
+                    if (!tableGetValue(&AS_MAP(peek(vm, 1))->table, peek(vm, 0), &value)) value = NIL_VAL;
+                    vm->stackTop--;
+                    vm->stackTop[-1] = value;
+                    break;
+                }
+                if (!IS_LIST(peek(vm, 1))) {
+                    runtimeError(vm, "Can only index lists and maps.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjList* list = AS_LIST(peek(vm, 1));
+                int index;
+                if (!listIndex(vm, list, peek(vm, 0), &index)) return INTERPRET_RUNTIME_ERROR;
+                vm->stackTop--;
+                vm->stackTop[-1] = listGet(list, index);
+                break;
+            }
+            case OP_SET_INDEX: {
+                if (IS_MAP(peek(vm, 2))) {
+                    if (!checkMapKey(vm, peek(vm, 1))) return INTERPRET_RUNTIME_ERROR;
+                    Value value = peek(vm, 0);
+                    mapSet(vm, AS_MAP(peek(vm, 2)), peek(vm, 1), value);
+                    vm->stackTop -= 2;
+                    vm->stackTop[-1] = value;
+                    break;
+                }
+                if (!IS_LIST(peek(vm, 2))) {
+                    runtimeError(vm, "Can only index lists and maps.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjList* list = AS_LIST(peek(vm, 2));
+                int index;
+                if (!listIndex(vm, list, peek(vm, 1), &index)) return INTERPRET_RUNTIME_ERROR;
+                Value value = peek(vm, 0);
+                listSet(vm, list, index, value);
+                vm->stackTop -= 2;
+                vm->stackTop[-1] = value;
+                break;
+            }
+            case OP_CLASS:
+                push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+                break;
+            case OP_INHERIT: {
+                if (!IS_CLASS(peek(vm, 1))) {
+                    runtimeError(vm, "Superclass must be a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjClass* superclass = AS_CLASS(peek(vm, 1));
+                ObjClass* subclass = AS_CLASS(peek(vm, 0));
+                tableAddAll(&superclass->methods, &subclass->methods);
+                subclass->superclass = superclass;
+                subclass->initializer = superclass->initializer;
+                vm->stackTop -= 2;
+                break;
+            }
+            case OP_METHOD: {
+                ObjString* name = READ_STRING();
+                ObjClass* klass = AS_CLASS(peek(vm, 1));
+                ObjFunction* method = AS_FUNCTION(peek(vm, 0));
+                method->owner = klass;
+                tableSet(&klass->methods, name, OBJ_VAL(method));
+                if (name->length == 4 && memcmp(name->chars, "init", 4) == 0) klass->initializer = method;
+                vm->stackTop--;
+                break;
+            }
+            case OP_GET_PROPERTY: {
+                ObjString* name = READ_STRING();
+                InlineCache* cache = &vm->chunk->caches[READ_SHORT()];
+                if (!getProperty(vm, name, cache)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_SET_PROPERTY: {
+                ObjString* name = READ_STRING();
+                InlineCache* cache = &vm->chunk->caches[READ_SHORT()];
+                if (!setProperty(vm, name, cache)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_INVOKE: {
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                InlineCache* cache = &vm->chunk->caches[READ_SHORT()];
+                if (!invoke(vm, name, argCount, cache)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_GET_SUPER: {
+                ObjString* name = READ_STRING();
+                if (!bindMethod(vm, currentSuperclass(vm), name)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_SUPER_INVOKE: {
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                Value method;
+                if (!tableGet(&currentSuperclass(vm)->methods, name, &method)) {
+                    runtimeError(vm, "Undefined property '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!call(vm, AS_FUNCTION(method), argCount)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                if (!tailCall(vm, peek(vm, argCount), argCount)) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
-            case OP_POP: pop(); break;
 
             case OP_RETURN: {
-                //Exit
-                return INTERPRET_OK;
+                // The fiber's first frame: on to whichever fiber runs next.
+                if (vm->frameCount == 1) {
+                    if (!finishFiber(vm)) return INTERPRET_OK;
+                    break;
+                }
+
+                Value result = pop(vm);
+                vm->frameCount--;
+                vm->stackTop = vm->slots;
+                push(vm, result);
+
+                CallFrame* frame = &vm->frames[vm->frameCount - 1];
+                vm->chunk = frame->chunk;
+                vm->ip = frame->ip;
+                vm->slots = frame->slots;
+                break;
+            }
+
+            /*Register operations*/
+            case OP_ADD_RK: {
+                Value l = READ_REGISTER();
+                Value r = READ_REGISTER();
+                Value result;
+                if (!addRegisters(vm, l, r, &result)) return INTERPRET_RUNTIME_ERROR;
+                push(vm, result);
+                break;
+            }
+            case OP_SUBTRACT_RK: REGISTER_OP(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_RK: REGISTER_OP(NUMBER_VAL, *); break;
+            case OP_DIVIDE_RK:   REGISTER_OP(NUMBER_VAL, /); break;
+            case OP_GREATER_RK:  REGISTER_OP(BOOL_VAL, >); break;
+            case OP_LESS_RK:     REGISTER_OP(BOOL_VAL, <); break;
+            case OP_EQUAL_RK: {
+                Value l = READ_REGISTER();
+                Value r = READ_REGISTER();
+                push(vm, BOOL_VAL(valuesEqual(l, r)));
+                break;
+            }
+            case OP_ADD_RK_SET: {
+                uint8_t slot = READ_BYTE();
+                Value l = READ_REGISTER();
+                Value r = READ_REGISTER();
+                if (!addRegisters(vm, l, r, &vm->slots[slot])) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_SUBTRACT_RK_SET: REGISTER_SET_OP(-); break;
+            case OP_MULTIPLY_RK_SET: REGISTER_SET_OP(*); break;
+            case OP_DIVIDE_RK_SET:   REGISTER_SET_OP(/); break;
+
+            /*Quickened operations*/
+            case OP_ADD_NUM:      NUMBER_OP(NUMBER_VAL, +, OP_ADD); break;
+            case OP_SUBTRACT_NUM: NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); break;
+            case OP_MULTIPLY_NUM: NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); break;
+            case OP_DIVIDE_NUM:   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); break;
+            case OP_GREATER_NUM:  NUMBER_OP(BOOL_VAL, >, OP_GREATER); break;
+            case OP_LESS_NUM:     NUMBER_OP(BOOL_VAL, <, OP_LESS); break;
+            case OP_ADD_STR: {
+                if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) {
+                    DESPECIALIZE(OP_ADD);
+                    break;
+                }
+                concatenate(vm);
+                break;
             }
+
+            /*Operations on operands the compiler proved to be numbers*/
+            case OP_ADD_UNCHECKED:      UNCHECKED_OP(NUMBER_VAL, +); break;
+            case OP_SUBTRACT_UNCHECKED: UNCHECKED_OP(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_UNCHECKED: UNCHECKED_OP(NUMBER_VAL, *); break;
+            case OP_DIVIDE_UNCHECKED:   UNCHECKED_OP(NUMBER_VAL, /); break;
+            case OP_GREATER_UNCHECKED:  UNCHECKED_OP(BOOL_VAL, >); break;
+            case OP_LESS_UNCHECKED:     UNCHECKED_OP(BOOL_VAL, <); break;
+            case OP_NEGATE_UNCHECKED:
+                vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
+                break;
         }
     }
 
@@ -227,22 +868,145 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef DESPECIALIZE
+#undef NUMBER_OP
+#undef UNCHECKED_OP
+#undef READ_REGISTER
+#undef REGISTER_OP
+#undef REGISTER_SET_OP
+}
+
+static InterpretResult runUntraced(VM* vm){
+    return execute(vm, false, false);
 }
 
-InterpretResult interpret(const char* source){
-    Chunk chunk;
-    initChunk(&chunk);
+static InterpretResult runTraced(VM* vm){
+    return execute(vm, true, false);
+}
+
+static InterpretResult runBetweenJit(VM* vm){
+    return execute(vm, false, true);
+}
 
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+/* Runs native code for the running chunk, compiling it the first time, and
+ * the interpreter for whatever that code leaves to it: instructions it
+ * doesn't handle and failed type guards. Native code calls and returns on
+ * its own, coming back here to enter the next chunk's code. Runtime errors
+ * are mostly reported by the interpreter re-running the instruction. */
+static InterpretResult runJit(VM* vm){
+    while (true) {
+        if (traceToggles != vm->traceToggleSeen) return INTERPRET_SWITCH_LOOP;
+        Chunk* chunk = vm->chunk;
+        if (chunk->jit == NULL) {
+            CallFrame* frame = &vm->frames[vm->frameCount - 1];
+            chunk->jit = jitCompile(chunk, frame->function != NULL ? frame->function->name->chars : "script");
+            if (chunk->jit == NULL) return runUntraced(vm);
+            if (inImage(vm, chunk)) keepImageJit(vm, chunk);
+        }
+
+        int resume = jitExecute(vm, chunk->jit, (int) (vm->ip - chunk->code));
+        if (resume == JIT_RUNTIME_ERROR) return INTERPRET_RUNTIME_ERROR;
+        if (resume == JIT_SWITCHED) continue;
+        vm->ip = chunk->code + resume;
+        InterpretResult result = runBetweenJit(vm);
+        if (result != INTERPRET_ENTER_JIT) return result;
     }
+}
+
+static InterpretResult run(VM* vm){
+    while (true) {
+        InterpretResult result;
+        if (vm->traceExecution) result = runTraced(vm);
+        else if (vm->jit) result = runJit(vm);
+        else result = runUntraced(vm);
+        if (result != INTERPRET_SWITCH_LOOP) return result;
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+        vm->traceToggleSeen = traceToggles;
+        vm->traceExecution = !vm->traceExecution;
+    }
+}
+
+static bool showsQuickening(VM* vm){
+#ifdef DEBUG_STATS
+    (void) vm;
+    return true;
+#else
+    return vm->traceExecution || vm->printCode;
+#endif
+}
+
+static void unquickenScript(Chunk* chunk){
+    unquickenChunk(chunk);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) unquickenScript(&AS_FUNCTION(constant)->chunk);
+    }
+}
+
+CachedChunk* compileCached(VM* vm, const char* source){
+    int length = (int) strlen(source);
+    CachedChunk* entry = findCached(&vm->chunks, source, length, vm->registerCode);
+    if (entry != NULL) {
+        // Listed, traced and counted as freshly compiled, whatever earlier runs
+        // quickened. Otherwise a hit keeps its quickened code.
+        if (showsQuickening(vm)) unquickenScript(&entry->chunk);
+        return entry;
+    }
+
+    entry = addCached(&vm->chunks, source, length, vm->registerCode);
+    if (!compile(vm, source, &entry->chunk)) {
+        invalidateCached(&vm->chunks, entry);
+        releaseCached(&vm->chunks, entry);
+        return NULL;
+    }
+    return entry;
+}
+
+InterpretResult interpretCached(VM* vm, CachedChunk* entry){
+    return interpretChunk(vm, &entry->chunk);
+}
+
+InterpretResult interpretChunk(VM* vm, Chunk* chunk){
+    // Runs on the main fiber, which is empty between scripts.
+    if (vm->fiber->frameCapacity == 0) growFrames(vm);
+    if (chunk->maxStack > vm->fiber->stackCapacity && !growStack(vm, chunk->maxStack))
+        return INTERPRET_RUNTIME_ERROR;
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
+    vm->slots = vm->fiber->stack;
+    vm->frames[0].function = NULL;
+    vm->frames[0].chunk = chunk;
+    vm->frames[0].slots = vm->fiber->stack;
+    vm->frameCount = 1;
+
+    if (vm->startupClock != 0) {
+        fprintf(stderr, "startup: %.1f us\n", (timelineClock() - vm->startupClock) / 1e3);
+        vm->startupClock = 0;
+    }
+
+    TIMELINE_BEGIN("run");
+    InterpretResult result = run(vm);
+    TIMELINE_END("run");
+    if (vm->traceExecution || vm->printCode) fflush(vm->traceOut);
+    return result;
+}
+
+InterpretResult runQueued(VM* vm){
+    vm->holdFibers = false;
+    if (!enterQueuedFiber(vm)) return INTERPRET_OK;
+
+    TIMELINE_BEGIN("run");
+    InterpretResult result = run(vm);
+    TIMELINE_END("run");
+    if (vm->traceExecution || vm->printCode) fflush(vm->traceOut);
+    return result;
+}
 
-    InterpretResult result = run();
+InterpretResult interpret(VM* vm, const char* source){
+    CachedChunk* entry = compileCached(vm, source);
+    if (entry == NULL) return INTERPRET_COMPILE_ERROR;
 
-    freeChunk(&chunk);
+    InterpretResult result = interpretCached(vm, entry);
+    releaseCached(&vm->chunks, entry);
     return result;
 }